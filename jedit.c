@@ -12,18 +12,32 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <errno.h>
+#include <signal.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <time.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <limits.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SEARCH_X86
+#endif
 
 #define VERSION "0.0.1"
 #define TAB_STOP 4
 #define QUIT_TIMES 1
+#define MESSAGE_SECS 5 // how long a status message stays up
 
 #define CTRL_KEY(k) ((k) & 0x1f) //011111
 
@@ -38,7 +52,8 @@ enum EditorKey{
     DEL_KEY,
     PAGE_UP,
     PAGE_DOWN,
-    
+    PASTE_START,
+    PASTE_END,
 };
 
 enum EditorHighlight{
@@ -55,6 +70,27 @@ enum EditorHighlight{
 #define HL_HIGHLIGHT_NUMBERS (1<<0) // 01
 #define HL_HIGHLIGHT_STRINGS (1<<1) // 10
 
+#define HL_STATE_COMMENT (1<<0)
+#define HL_STATE_KNOWN (1<<7)
+#define HL_STATE_NONE 0xff
+#define HL_CLEAN INT64_MAX
+#define HL_DIRTY_MAX 16
+
+typedef struct KeywordSlot{
+    const char *word;
+    unsigned char len;
+    unsigned char hl;
+} KeywordSlot;
+
+// Collision free hash of an EditorSyntax's keywords, built the first time it is selected
+typedef struct KeywordTable{
+    unsigned int seed;
+    unsigned int mask;
+    int max_len;
+    KeywordSlot *slot;
+    unsigned char sep[256]; // is_separator() for every byte
+} KeywordTable;
+
 typedef struct EditorSyntax{
     char *filetype;
     char **filematch;
@@ -63,27 +99,210 @@ typedef struct EditorSyntax{
     char *multiline_comment_start;
     char *multiline_comment_end;
     int flags;
+    KeywordTable *keyword_table;
 } EditorSyntax;
 
+#define ROW_MAPPED (1<<0) // chars point into the mapped file and are not ours to free
+#define COL_CHECK 4096 // chars between the column checkpoints of a long row
+
+// What a row only needs once it is drawn or its columns are asked for, kept
+// out of Erow so the many rows that never are stay small
+typedef struct RowCols{
+    int n; // checkpoints still good, from the row start
+    int cap;
+    int64_t col[];
+}RowCols;
+
+typedef struct RowView{
+    char *render; // NULL while the row has no tabs and renders as its chars
+    union{
+        unsigned char *p;
+        unsigned char in[sizeof(unsigned char *)]; // the runs themselves while they fit
+    }hl; // runs of one highlight, see hl_span_put
+    int64_t hl_len; // -1 until the row is first drawn
+    int64_t rsize;
+    int64_t rcap; // bytes allocated for render
+    RowCols *cols; // render column of every COL_CHECK-th char, for long rows
+}RowView;
+
+// Sizes and row numbers are 64-bit throughout, a mapped file can hold lines
+// past 2 GB and more than 2^31 of them
 typedef struct Erow{
-    int idx;
-    int size;
-    int rsize;
     char *chars;
-    char *render;
-    unsigned char *hl;
-    int hl_open_comment;
+    int64_t size;
+    int64_t cap; // bytes allocated for chars, 0 while they point into the map
+    RowView *view; // NULL until first needed
+    int vlines; // screen lines the row takes with soft wrap on, 0 with it off
+    int block; // trigram index block the row's trigrams are posted under
+    unsigned char hl_state; // lexer state at the end of the row
+    unsigned char hl_start; // lexer state hl was built from
+    unsigned char flags;
 }Erow;
 
+#define ROPE_LEAF_ROWS 64
+#define POOL_THREADS_MAX 8
+#define SPLIT_WINDOW (64 << 20) // bytes of the map split across the work pool at a time
+#define SPLIT_BULK_ROWS 100000 // rows wanted at once before splitting goes parallel
+#define ROPE_FANOUT 32
+
+// Rows live in the leaves of a b-tree keyed by row count, so finding,
+// inserting or deleting a row only touches one leaf and its ancestors
+typedef struct RopeNode{
+    struct RopeNode *parent;
+    struct RopeNode *prev, *next; // leaf chain, in file order
+    int leaf;
+    int n; // rows in a leaf, children in an inner node
+    int64_t rows; // rows in this subtree
+    int64_t vlines; // wrapped screen lines of the rows in this subtree
+    int block_lo, block_hi; // trigram index blocks this leaf's rows are posted under
+    union{
+        struct RopeNode *child[ROPE_FANOUT];
+        Erow row[ROPE_LEAF_ROWS];
+    } u;
+}RopeNode;
+
+#define INDEX_BLOCK (256 << 10) // bytes of the map whose lines share postings
+#define INDEX_MIN_BYTES (64 << 20) // smaller files scan quick enough without one
+#define TRIGRAM_NONE 0xffffffffu
+
+typedef struct Posting{
+    unsigned int tri; // three bytes, the first one highest
+    int len;
+    int cap;
+    int *block; // ascending
+}Posting;
+
+// Which blocks of the mapped file hold each trigram. A row stays posted under
+// the block it came off the map from, or the one it was inserted in, and edits
+// only ever add postings, so a block missing from the postings of one trigram
+// of a query can't hold a match
+typedef struct TrigramIndex{
+    int nblocks; // 0 without an index
+    size_t *start; // offset of the first line starting in each block, and the map length
+    int *lines; // newlines in each block
+    Posting *slot; // open addressing, tri is TRIGRAM_NONE in an empty slot
+    unsigned int mask;
+    int used;
+    double build_time;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int built; // blocks the builder thread is done with
+    int ready; // the builder is done and the main thread owns it all
+    unsigned int *pending; // block and trigram pairs edits added before it was ready
+    int npending;
+    int pending_cap;
+}TrigramIndex;
+
+TrigramIndex tindex;
+
+#define HL_SYNC_ROWS 1000 // rows the main thread lexes itself to reach a state
+#define HL_BATCH_BYTES (1 << 20) // text the worker copies out and lexes at a time
+#define HL_BATCH_ROWS 4096
+
+// Lexer checkpoints for rows past the ones the main thread has been through
+// come from a worker. It copies a batch of rows out under the lock, lexes the
+// copy without it and publishes the end states only if no edit bumped
+// E.hl_gen in between. The main thread holds the lock except while it waits
+// for input
+typedef struct HlWorker{
+    int running;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    int64_t frontier; // rows above it have known end states, marks aside
+    int64_t want; // last row drawn without its state, -1 for none
+    long batches;
+    long discarded; // lexed across an edit and thrown away
+}HlWorker;
+
+HlWorker hl = {.want = -1};
+
+#define LOAD_CHUNK (8 << 20) // bytes of the map the loader reads in at a time
+
+// Reads a mapped file into memory ahead of the rows split off it, counting
+// its lines as it goes, so the status bar has the total and scrolling or
+// searching into the file later doesn't wait on the disk
+typedef struct Loader{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int running; // started and not joined yet
+    size_t loaded; // bytes read in, written by the loader under the lock
+    int64_t lines; // newlines in them
+    size_t seen; // the main thread's copy of loaded
+    int64_t seen_lines;
+}Loader;
+
+Loader loader;
+
+#define UNDO_BUDGET_MB 64 // history kept in memory, JEDIT_UNDO_MB in the environment overrides it
+#define UNDO_RUN_MAX 4096 // bytes of typing one op takes before the next begins
+#define UNDO_STEP (1<<7) // set on the type of the first op of an undo step
+#define UNDO_BLOCK 65536 // history written out is read back this much at a time
+
+enum UndoType{
+    UNDO_INSERT, // bytes put in a row
+    UNDO_DELETE, // bytes taken out of a row
+    UNDO_INSERT_ROW,
+    UNDO_DELETE_ROW
+};
+
+enum UndoKind{ // what the key being handled does, for typing to run on
+    UNDO_KEY_OTHER,
+    UNDO_KEY_TYPE,
+    UNDO_KEY_DELETE
+};
+
+// Every edit appends an op to the log, and undo walks it back a step at a
+// time, a step being what one key did. Redo walks it forward again until the
+// next edit cuts it off. The oldest ops are written out to an unlinked temp
+// file once the rest passes the budget, so the log holds offsets [0, end),
+// [0, base) of them in the file and the rest in buf
+typedef struct UndoLog{
+    unsigned char *buf;
+    size_t cap;
+    int64_t base;
+    int64_t end;
+    int64_t pos; // ops before it are done, ops from it on were undone
+    int64_t last; // start of the last op, -1 if the next may not run on in it
+    int64_t budget;
+    unsigned char *block; // the last block read back from the file
+    int64_t block_off, block_len;
+    int64_t cy, cx; // cursor when the key being handled came
+    int fd; // -1 until history is first written out
+    int kind; // UndoKind of the key being handled
+    int step; // the next op begins a step
+    int logged; // the key being handled logged an op
+    int off; // undoing, redoing or benching, which logs nothing
+}UndoLog;
+
+UndoLog undo = {.last = -1, .fd = -1, .step = 1};
+
 struct EditorConfig {
-    int cx, cy;
-    int rx;
-    int row_off;
-    int col_off;
+    int64_t cx, cy;
+    int64_t rx;
+    int64_t row_off;
+    int64_t col_off;
+    int64_t wrap_off; // screen lines of row_off above the screen, with soft wrap
+    int cur_y, cur_x; // where the cursor goes on screen
+    int wrap; // rows too wide for the screen go on over the lines below, toggled with Ctrl-W
     int screen_rows;
     int screen_cols;
-    int num_rows;
-    Erow *row;
+    int64_t num_rows;
+    RopeNode *root;
+    char *map; // file opened with mmap, rows are split off it on demand
+    size_t map_len;
+    size_t map_off; // first byte not yet split into rows
+    int map_file; // map is the saved file itself, not a copy or a file renamed over since
+    int64_t map_lines; // newlines before map_off
+    int64_t hl_dirty[HL_DIRTY_MAX]; // rows from each mark on may have a stale hl_state, lowest mark last
+    int hl_ndirty;
+    unsigned long hl_gen; // bumped by every edit to the rows
+    int match_cur; // index of the current search match, -1 outside of find
+    int64_t match_row; // row the current match is shown in over its hl, -1 for none
+    int64_t match_rx; // render columns of the match
+    int64_t match_len;
+    long match_total;
+    int match_regex; // find takes the query for a regex, toggled with Ctrl-E
     int dirty;
     char *filename;
     char statusmsg[80];
@@ -110,7 +329,7 @@ char *PY_HL_keywords[] = {
     "is", "return", "as", "def", "from", "nonlocal", "while", "async", "elif", "if",
     "not", "with", "assert", "del", "global", "or", "yield",
     "str|", "int|", "float|", "complex|", "list|", "tuple|", "range|", "dict|", "set|",
-    "frozenset|", "bool|", "bytes|", "bytearray|", "memoryview|", "NoneType|"
+    "frozenset|", "bool|", "bytes|", "bytearray|", "memoryview|", "NoneType|", NULL
 }; // Wtf are some of these
 
 EditorSyntax HLDB[] = {
@@ -119,14 +338,16 @@ EditorSyntax HLDB[] = {
         C_HL_extensions,
         C_HL_keywords,
         "//", "/*", "*/",
-        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+        NULL
     },
     {
         "python",
         PY_HL_extensions,
         PY_HL_keywords,
         "#", NULL, NULL,
-        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+        NULL
     },
 };
 
@@ -134,7 +355,15 @@ EditorSyntax HLDB[] = {
 
 //---Prototypes---
 void editor_set_status_message(const char *fmt, ...);
+void hl_release();
+int editor_hl_near(int64_t at);
+int editor_row_vlines(Erow *row);
+int pool_threads();
+void pool_run(void (*fn)(void *), void *jobs, size_t job_size, int n);
 void editor_refresh_screen();
+void undo_log(int type, int64_t row, int64_t at, const char *s, int64_t len);
+void editor_wrap_row(int64_t at);
+int64_t editor_top_line();
 char *editor_prompt(char *prompt, void (*callback)(char *, int));
 
 //---terminal---
@@ -147,6 +376,7 @@ void die(const char *s){
 }
 
 void disable_raw_mode(){
+    write(STDOUT_FILENO, "\x1b[?2004l", 8); // bracketed paste off
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1){
         die("tcsetattr");
     }
@@ -163,66 +393,155 @@ void enable_raw_mode(){
     raw.c_oflag &= ~(OPOST);
     raw.c_cflag |= (CS8);
     raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
-    raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 1;
+    raw.c_cc[VMIN] = 0; // reads never block, poll does the waiting
+    raw.c_cc[VTIME] = 0;
 
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1){
         die("tcsetattr");
     }
+    write(STDOUT_FILENO, "\x1b[?2004h", 8); // bracketed paste on
 }
 
-int editor_read_key(){
-    int nread;
-    char c;
-    while((nread = read(STDIN_FILENO, &c, 1)) != 1){
-        if (nread == -1 && errno != EAGAIN){
-            die("read");
-        }
+//---input ring---
+#define INPUT_RING 4096 // a power of two
+#define INPUT_ESC_MS 100 // how long the rest of an escape sequence may take
+
+// Bytes read off stdin and not decoded yet. A held key or a paste lands in
+// one read and is decoded from here without another syscall
+typedef struct Input{
+    unsigned char buf[INPUT_RING];
+    unsigned int head, tail; // decode from head, read in at tail, both wrap
+    long reads;
+    long keys;
+    int wake[2]; // pipe other threads poke to have an idle main thread draw a frame
+}Input;
+
+Input input = {.wake = {-1, -1}};
+
+// Opens the wake pipe, left shut the idle wait is only ended by keys
+void input_wake_open(){
+    if (pipe(input.wake) == -1) return;
+    fcntl(input.wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(input.wake[1], F_SETFL, O_NONBLOCK);
+}
+
+// Has the main thread draw a frame if it is waiting for input, from any thread
+void input_poke(){
+    if (input.wake[1] != -1) write(input.wake[1], "", 1);
+}
+
+// Waits up to timeout ms, -1 for ever, for stdin and reads all of it that fits.
+// The highlight worker gets the lock for the wait, and with wake set a poke
+// ends the wait early
+int input_fill(int timeout, int wake){
+    unsigned int used = input.tail - input.head;
+    if (used == INPUT_RING) return 0;
+
+    struct pollfd pfd[2] = {{STDIN_FILENO, POLLIN, 0}, {input.wake[0], POLLIN, 0}};
+    if (hl.running) hl_release();
+    int ready = poll(pfd, wake ? 2 : 1, timeout);
+    if (hl.running) pthread_mutex_lock(&hl.lock);
+    if (ready == -1 && errno != EINTR) die("poll");
+    if (pfd[1].revents & POLLIN){
+        char drain[64];
+        read(input.wake[0], drain, sizeof(drain));
     }
+    if (ready <= 0 || pfd[0].revents == 0) return 0;
+
+    unsigned int at = input.tail & (INPUT_RING - 1);
+    size_t room = INPUT_RING - used;
+    if (room > INPUT_RING - at) room = INPUT_RING - at;
+    ssize_t n = read(STDIN_FILENO, &input.buf[at], room);
+    if (n == -1 && errno != EAGAIN && errno != EINTR) die("read");
+    if (n == 0 && (pfd[0].revents & POLLHUP)) die("read");
+    if (n <= 0) return 0;
+    input.tail += n;
+    input.reads++;
+    return n;
+}
 
-    if (c == '\x1b'){
-        char seq[5];
+int input_peek(unsigned int i){
+    return input.buf[(input.head + i) & (INPUT_RING - 1)];
+}
 
-        if (read(STDIN_FILENO, seq, 1) != 1) return '\x1b';
-        if (read(STDIN_FILENO, seq + 1, 1) != 1) return '\x1b';
+// Whether a key is waiting, in the ring or on stdin
+int input_pending(){
+    return input.head != input.tail || input_fill(0, 0) > 0;
+}
 
-        if (seq[0] == '['){
-            // CTRL ARROWS
-            if (seq[1] == '1'){
-                // Try to read cntrl arrow
-                if (read(STDIN_FILENO, &seq[2], 3) != 3) return '\x1b';
-                if (seq[2] == ';' && seq[3] == '5'){
-                    switch (seq[4]){
-                        case 'D' : return CTRL_LEFT;
-                        case 'C' : return CTRL_RIGHT;
-                        case 'A' : return ARROW_UP;
-                        case 'B' : return ARROW_DOWN;
-                    }
-                }
-            }
-            if (seq[1] >= '0' && seq[1] <= '9'){
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
-                if (seq[2] == '~'){
-                    switch (seq[1]){
-                        case '3': return DEL_KEY;
-                        case '5': return PAGE_UP;
-                        case '6': return PAGE_DOWN;
-                    }
-                }
-            }else{
-                switch(seq[1]){
-                    case 'A': return ARROW_UP;
-                    case 'B': return ARROW_DOWN;
-                    case 'C': return ARROW_RIGHT;
-                    case 'D': return ARROW_LEFT;
-                }
+// Next byte, waiting up to timeout ms for one, -1 if none came
+int input_getc(int timeout, int wake){
+    if (input.head == input.tail && !input_fill(timeout, wake)) return -1;
+    return input.buf[input.head++ & (INPUT_RING - 1)];
+}
+
+typedef struct KeySeq{
+    const char *seq; // what follows the escape
+    int key;
+}KeySeq;
+
+const KeySeq key_seqs[] = {
+    {"[A", ARROW_UP},
+    {"[B", ARROW_DOWN},
+    {"[C", ARROW_RIGHT},
+    {"[D", ARROW_LEFT},
+    {"[1;5A", ARROW_UP},
+    {"[1;5B", ARROW_DOWN},
+    {"[1;5C", CTRL_RIGHT},
+    {"[1;5D", CTRL_LEFT},
+    {"[3~", DEL_KEY},
+    {"[5~", PAGE_UP},
+    {"[6~", PAGE_DOWN},
+    {"[200~", PASTE_START},
+    {"[201~", PASTE_END}, // a paste's end is read with it, one read alone is stray
+};
+
+#define KEY_SEQS (sizeof(key_seqs) / sizeof(key_seqs[0]))
+
+// How long poll may sleep, until the status message is due to go away
+int input_idle_timeout(){
+    time_t left = E.statusmsg_time + MESSAGE_SECS - time(NULL);
+    if (E.statusmsg[0] == '\0' || left <= 0) return -1;
+    return left * 1000;
+}
+
+// Blocks in poll until a key is in, waking while idle only to take down the
+// status message or draw highlighting the worker caught up on. An escape is
+// matched against key_seqs, waiting a little for more bytes only while what
+// is in could still become one of them
+int editor_read_key(){
+    int c;
+    while ((c = input_getc(input_idle_timeout(), 1)) == -1) editor_refresh_screen();
+    input.keys++;
+    if (c != '\x1b') return c;
+
+    unsigned int avail;
+    for (;;){
+        avail = input.tail - input.head;
+        int partial = 0;
+        unsigned int j;
+        for (j = 0; j < KEY_SEQS; j++){
+            const char *s = key_seqs[j].seq;
+            unsigned int i = 0;
+            while (s[i] && i < avail && input_peek(i) == (unsigned char)s[i]) i++;
+            if (s[i] == '\0'){
+                input.head += i;
+                return key_seqs[j].key;
             }
+            if (i == avail) partial = 1;
         }
+        if (!partial || !input_fill(INPUT_ESC_MS, 0)) break;
+    }
 
-        return '\x1b';
-    }else{
-        return c; 
+    // Something unknown, a whole CSI sequence or one byte after the escape is dropped
+    if (avail && input_peek(0) == '['){
+        unsigned int i = 1;
+        while (i < avail && (input_peek(i) < 0x40 || input_peek(i) > 0x7e)) i++;
+        input.head += i < avail ? i + 1 : avail;
+    }else if (avail){
+        input.head++;
     }
+    return '\x1b';
 }
 
 int get_cursor_position(int *rows, int *cols){
@@ -232,7 +551,9 @@ int get_cursor_position(int *rows, int *cols){
     if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
 
     while (i < sizeof(buf) -1){
-        if (read(STDIN_FILENO, &buf[i], 1) != 1) break;
+        int c = input_getc(INPUT_ESC_MS, 0);
+        if (c == -1) break;
+        buf[i] = c;
         if (buf[i] == 'R') break;
         i++;
     }
@@ -257,468 +578,3678 @@ int get_window_size(int *rows, int *cols){
     }
 }
 
-//---syntax highlighting---
-int is_separator(int c){
-    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[]{}:;", c) != NULL;
+//---slabs---
+#define SLAB_BYTES (1 << 20)
+#define SLAB_CLASSES 10
+#define SLAB_MAX 512
+
+// Block sizes, each about half again the one before
+const int slab_sizes[SLAB_CLASSES] = {16, 32, 48, 64, 96, 128, 192, 256, 384, 512};
+
+// Short row text, render and hl and the row views come out of big slabs,
+// with a free list per size class, so a short row costs no malloc of its
+// own. Bigger blocks go to malloc. Sizes come from slab_size and are handed
+// back on free, the main thread is the only user
+typedef struct Slabs{
+    void *free[SLAB_CLASSES]; // freed blocks, linked through their first bytes
+    char *next; // what is left of the newest slab
+    char *end;
+    long slabs;
+    long blocks; // handed out and not freed
+}Slabs;
+
+Slabs slabs;
+
+int slab_class(size_t n){
+    int c = 0;
+    while ((size_t)slab_sizes[c] < n) c++;
+    return c;
+}
+
+// What a block asked for as n bytes really holds
+size_t slab_size(size_t n){
+    return n <= SLAB_MAX ? (size_t)slab_sizes[slab_class(n)] : n;
 }
 
-void editor_update_syntax(Erow *row){
-    row->hl = realloc(row->hl, row->rsize);
-    memset(row->hl, HL_NORMAL, row->rsize);
+void *slab_alloc(size_t n){
+    if (n > SLAB_MAX){
+        void *p = malloc(n);
+        if (p == NULL) die("malloc");
+        return p;
+    }
+    int c = slab_class(n);
+    slabs.blocks++;
+    void *p = slabs.free[c];
+    if (p){
+        slabs.free[c] = *(void **)p;
+        return p;
+    }
+    size_t size = slab_sizes[c];
+    if (slabs.end - slabs.next < (ptrdiff_t)size){
+        slabs.next = malloc(SLAB_BYTES); // the tail of the old one is left unused
+        if (slabs.next == NULL) die("malloc");
+        slabs.end = slabs.next + SLAB_BYTES;
+        slabs.slabs++;
+    }
+    p = slabs.next;
+    slabs.next += size;
+    return p;
+}
 
-    if (E.syntax == NULL) return;
+void slab_free(void *p, size_t n){
+    if (p == NULL) return;
+    if (n > SLAB_MAX){
+        free(p);
+        return;
+    }
+    int c = slab_class(n);
+    *(void **)p = slabs.free[c];
+    slabs.free[c] = p;
+    slabs.blocks--;
+}
 
-    char **keywords = E.syntax->keywords;
+void *slab_realloc(void *p, size_t old, size_t n){
+    if (p && old > SLAB_MAX && n > SLAB_MAX){
+        p = realloc(p, n);
+        if (p == NULL) die("realloc");
+        return p;
+    }
+    void *q = slab_alloc(n);
+    if (p) memcpy(q, p, old < n ? old : n);
+    slab_free(p, old);
+    return q;
+}
 
-    char *scs = E.syntax->single_line_comment_start;
-    char *mcs = E.syntax->multiline_comment_start;
-    char *mce = E.syntax->multiline_comment_end;
+//---row storage---
+RopeNode *rope_new_node(int leaf){
+    RopeNode *node = calloc(1, sizeof(RopeNode));
+    if (node == NULL) die("calloc");
+    node->leaf = leaf;
+    return node;
+}
 
-    int scs_len = scs ? strlen(scs) : 0;
-    int mcs_len = mcs ? strlen(mcs) : 0;
-    int mce_len = mce ? strlen(mce) : 0;
+void rope_add_rows(RopeNode *node, int64_t delta){
+    for (; node; node = node->parent) node->rows += delta;
+}
 
-    int prev_sep = 1;
-    int in_string = 0;
-    int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+void rope_add_vlines(RopeNode *node, int64_t delta){
+    for (; node; node = node->parent) node->vlines += delta;
+}
 
+int rope_child_index(RopeNode *parent, RopeNode *child){
     int i = 0;
-    while (i < row->rsize){
-        char c = row->render[i];
-        unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
-
-        // Comments
-        if (scs_len && !in_string && !in_comment){
-            if (!strncmp(row->render + i, scs, scs_len)){
-                memset(row->hl + i, HL_COMMENT, row->rsize - i);
-                break;
-            }
-        }
+    while (parent->u.child[i] != child) i++;
+    return i;
+}
 
-        if (mcs_len && mce_len && !in_string){
-            if (in_comment){
-                row->hl[i] = HL_MLCOMMENT;
-                if (!strncmp(&row->render[i], mce, mce_len)){
-                    memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-                    i += mce_len;
-                    in_comment = 0;
-                    prev_sep = 1;
-                    continue;
-                } else{
-                    i++;
-                    continue;
-                }
-            } else if (!strncmp(&row->render[i], mcs, mcs_len)){
-                memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-                i += mcs_len;
-                in_comment = 1;
-                continue;
-            }
+// Walks down to the leaf holding row `at`, at == E.num_rows lands past the end of the last leaf
+RopeNode *rope_find(int64_t at, int *off){
+    RopeNode *node = E.root;
+    while (!node->leaf){
+        int i;
+        for (i = 0; i < node->n - 1; i++){
+            if (at < node->u.child[i]->rows) break;
+            at -= node->u.child[i]->rows;
         }
+        node = node->u.child[i];
+    }
+    *off = at;
+    return node;
+}
 
+// Links `sib` in after `node`, sib's rows must already be counted in node's ancestors
+void rope_insert_after(RopeNode *node, RopeNode *sib){
+    RopeNode *parent = node->parent;
+    if (parent == NULL){
+        parent = rope_new_node(0);
+        parent->u.child[0] = node;
+        parent->n = 1;
+        parent->rows = node->rows + sib->rows;
+        parent->vlines = node->vlines + sib->vlines;
+        node->parent = parent;
+        E.root = parent;
+    }
 
-        // Strings
-        if (E.syntax->flags & HL_HIGHLIGHT_STRINGS){
-            if (in_string){
-                row->hl[i] = HL_STRING;
-                if (c == '\\' && i + 1 < row->rsize){
-                    row->hl[i + 1] = HL_STRING;
-                    i += 2;
-                    continue;
-                }
-                if (c == in_string) in_string = 0;
-                i++;
-                prev_sep = 1;
-                continue;
-            }else{
-                if (c == '"' || c == '\''){
-                    in_string = c;
-                    row->hl[i] = HL_STRING;
-                    i++;
-                    continue;
-                }
-            }
+    if (parent->n == ROPE_FANOUT){
+        RopeNode *right = rope_new_node(0);
+        int half = ROPE_FANOUT / 2;
+        int j;
+        for (j = half; j < ROPE_FANOUT; j++){
+            RopeNode *c = parent->u.child[j];
+            right->u.child[right->n++] = c;
+            right->rows += c->rows;
+            right->vlines += c->vlines;
+            c->parent = right;
         }
-        // Numbers
-        if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS){
-            if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
-                (c == '.' && prev_hl == HL_NUMBER)){
-                row->hl[i] = HL_NUMBER;
-                i++;
-                prev_sep = 0;
-                continue;
-            }
+        parent->n = half;
+        parent->rows -= right->rows;
+        parent->vlines -= right->vlines;
+        rope_insert_after(parent, right);
+        if (node->parent == right){
+            parent->rows -= sib->rows;
+            right->rows += sib->rows;
+            parent->vlines -= sib->vlines;
+            right->vlines += sib->vlines;
+            parent = right;
         }
+    }
 
-        if (prev_sep){
-            int j;
-            for (j = 0; keywords[j] != NULL; j++){
-                int klen = strlen(keywords[j]);
-                int kw2 = keywords[j][klen - 1] == '|';
-                if (kw2) klen--;
+    int i = rope_child_index(parent, node);
+    memmove(&parent->u.child[i + 2], &parent->u.child[i + 1],
+        sizeof(RopeNode *) * (parent->n - i - 1));
+    parent->u.child[i + 1] = sib;
+    parent->n++;
+    sib->parent = parent;
+}
 
-                if (!strncmp(&row->render[i], keywords[j], klen) && 
-                    is_separator(row->render[i + klen])) {
+void rope_remove_node(RopeNode *node){
+    RopeNode *parent = node->parent;
+    int i = rope_child_index(parent, node);
+    memmove(&parent->u.child[i], &parent->u.child[i + 1],
+        sizeof(RopeNode *) * (parent->n - i - 1));
+    parent->n--;
 
-                    memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-                    i += klen;
-                    break;
-                }
-            }
-            if (keywords[j] != NULL){
-                prev_sep = 0;
-                continue;
-            }
-        }
+    if (node->leaf){
+        if (node->prev) node->prev->next = node->next;
+        if (node->next) node->next->prev = node->prev;
+    }
+    free(node);
 
-        prev_sep = is_separator(c);
-        i++;
+    if (parent->n == 0 && parent != E.root){
+        rope_remove_node(parent);
+    }
+    while (!E.root->leaf && E.root->n == 1){
+        RopeNode *old = E.root;
+        E.root = old->u.child[0];
+        E.root->parent = NULL;
+        free(old);
+    }
+}
+
+// Opens a gap for a new row at `at` and returns it, the caller fills it in
+Erow *rope_insert_row(int64_t at){
+    int off;
+    RopeNode *leaf = rope_find(at, &off);
+
+    if (leaf->n == ROPE_LEAF_ROWS){
+        // Appending at the very end starts a fresh leaf instead of splitting in half
+        int move = (off == leaf->n && leaf->next == NULL) ? 0 : ROPE_LEAF_ROWS / 2;
+        RopeNode *sib = rope_new_node(1);
+        memcpy(sib->u.row, &leaf->u.row[leaf->n - move], sizeof(Erow) * move);
+        sib->n = sib->rows = move;
+        sib->block_lo = leaf->block_lo;
+        sib->block_hi = leaf->block_hi;
+        int j;
+        for (j = 0; j < move; j++) sib->vlines += sib->u.row[j].vlines;
+        leaf->n -= move;
+        leaf->rows -= move;
+        leaf->vlines -= sib->vlines;
+
+        sib->prev = leaf;
+        sib->next = leaf->next;
+        if (leaf->next) leaf->next->prev = sib;
+        leaf->next = sib;
+        rope_insert_after(leaf, sib);
+
+        if (off > leaf->n || leaf->n == ROPE_LEAF_ROWS){
+            off -= leaf->n;
+            leaf = sib;
+        }
     }
 
-    int changed = (row->hl_open_comment != in_comment);
-    row->hl_open_comment = in_comment;
-    if (changed && row->idx + 1 < E.num_rows)
-        editor_update_syntax(&E.row[row->idx + 1]); 
+    memmove(&leaf->u.row[off + 1], &leaf->u.row[off], sizeof(Erow) * (leaf->n - off));
+    leaf->n++;
+    rope_add_rows(leaf, 1);
+    leaf->u.row[off].vlines = 0; // counted once the caller fills it in
+    return &leaf->u.row[off];
 }
 
-int editor_syntax_to_color(int hl){
-    switch (hl){
-        case HL_MLCOMMENT:
-        case HL_COMMENT: return 36;
-		case HL_KEYWORD1: return 33;
-		case HL_KEYWORD2: return 32;       
-		case HL_STRING: return 35;
-        case HL_NUMBER: return 31;
-        case HL_MATCH: return 34;
-        default: return 37;
+void rope_delete_row(int64_t at){
+    int off;
+    RopeNode *leaf = rope_find(at, &off);
+
+    rope_add_vlines(leaf, -leaf->u.row[off].vlines);
+    memmove(&leaf->u.row[off], &leaf->u.row[off + 1], sizeof(Erow) * (leaf->n - off - 1));
+    leaf->n--;
+    rope_add_rows(leaf, -1);
+
+    if (leaf->n == 0 && leaf != E.root){
+        rope_remove_node(leaf);
+        return;
+    }
+
+    // Fold a thin leaf into its right neighbour so deletes don't leave a sparse tree
+    RopeNode *next = leaf->next;
+    if (leaf->n < ROPE_LEAF_ROWS / 4 && next && next->parent == leaf->parent &&
+        leaf->n + next->n <= ROPE_LEAF_ROWS){
+        memcpy(&leaf->u.row[leaf->n], next->u.row, sizeof(Erow) * next->n);
+        leaf->n += next->n;
+        leaf->rows += next->rows;
+        leaf->vlines += next->vlines;
+        if (next->block_lo < leaf->block_lo) leaf->block_lo = next->block_lo;
+        if (next->block_hi > leaf->block_hi) leaf->block_hi = next->block_hi;
+        next->rows = next->vlines = 0;
+        rope_remove_node(next);
     }
 }
 
-void editor_select_syntax_highlight(){
-    E.syntax = NULL;
-    if (E.filename == NULL) return;
+RopeNode *rope_first_leaf(){
+    RopeNode *node = E.root;
+    while (!node->leaf) node = node->u.child[0];
+    return node;
+}
 
-    char *ext = strrchr(E.filename, '.');
-    unsigned int j;
-    for (j = 0; j < HLDB_ENTRIES; j++){
-        EditorSyntax *s = &HLDB[j];
-        unsigned int i = 0;
-        while (s->filematch[i]){
-            int is_ext = (s->filematch[i][0] == '.');
-            if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-                (!is_ext && strstr(E.filename, s->filematch[i]))) {
-                E.syntax = s;     
+RopeNode *rope_last_leaf(){
+    RopeNode *node = E.root;
+    while (!node->leaf) node = node->u.child[node->n - 1];
+    return node;
+}
 
-                int file_row;
-                for (file_row = 0; file_row < E.num_rows; file_row++){
-                    editor_update_syntax(&E.row[file_row]);
-                }
+Erow *editor_row(int64_t at){
+    int off;
+    RopeNode *leaf = rope_find(at, &off);
+    return &leaf->u.row[off];
+}
 
-                return;
-            }
-            i++;
+// Wrapped screen lines above row `at`
+int64_t rope_vline(int64_t at){
+    RopeNode *node = E.root;
+    int64_t v = 0;
+    while (!node->leaf){
+        int i;
+        for (i = 0; i < node->n - 1; i++){
+            if (at < node->u.child[i]->rows) break;
+            at -= node->u.child[i]->rows;
+            v += node->u.child[i]->vlines;
         }
+        node = node->u.child[i];
     }
+    int j;
+    for (j = 0; j < at && j < node->n; j++) v += node->u.row[j].vlines;
+    return v;
 }
 
-//---row opperations---
-int editor_row_cx_to_rx(Erow *row, int cx){
-    int rx = 0;
+// Row that wrapped screen line v falls in, and which of its lines it is in
+// *sub. Lines past the last row go to E.num_rows
+int64_t rope_vline_row(int64_t v, int64_t *sub){
+    if (v >= E.root->vlines){
+        *sub = 0;
+        return E.num_rows;
+    }
+    RopeNode *node = E.root;
+    int64_t at = 0;
+    while (!node->leaf){
+        int i;
+        for (i = 0; i < node->n - 1; i++){
+            if (v < node->u.child[i]->vlines) break;
+            v -= node->u.child[i]->vlines;
+            at += node->u.child[i]->rows;
+        }
+        node = node->u.child[i];
+    }
     int j;
-    for (j = 0; j < cx; j++){
-        if (row->chars[j] == '\t')
-            rx += (TAB_STOP - 1) - (rx % TAB_STOP);
-        rx++;
+    for (j = 0; j < node->n - 1 && v >= node->u.row[j].vlines; j++) v -= node->u.row[j].vlines;
+    *sub = v;
+    return at + j;
+}
+
+//---loader---
+void *loader_run(void *arg){
+    (void)arg;
+    size_t off = 0;
+    int percent = 0;
+    while (off < E.map_len){
+        size_t n = E.map_len - off < LOAD_CHUNK ? E.map_len - off : LOAD_CHUNK;
+        if (off + n < E.map_len){
+            // The disk reads the next chunk in while this one is counted
+            size_t ahead = E.map_len - off - n < LOAD_CHUNK ? E.map_len - off - n : LOAD_CHUNK;
+            madvise(E.map + off + n, ahead, MADV_WILLNEED);
+        }
+        const char *p = E.map + off, *end = p + n;
+        int64_t lines = 0;
+        while ((p = memchr(p, '\n', end - p)) != NULL){
+            lines++;
+            p++;
+        }
+        off += n;
+
+        pthread_mutex_lock(&loader.lock);
+        loader.loaded = off;
+        loader.lines += lines;
+        pthread_mutex_unlock(&loader.lock);
+        if ((int)(off * 100 / E.map_len) != percent){
+            percent = off * 100 / E.map_len;
+            input_poke(); // for the status bar
+        }
     }
-    return rx;
+    return NULL;
 }
 
-int editor_row_rx_to_cx(Erow *row, int rx){
-    int cur_rx = 0;
-    int cx;
-    for (cx = 0; cx < row->size; cx++){
-        if (row->chars[cx] == '\t')
-            cur_rx += (TAB_STOP - 1) - (cur_rx % TAB_STOP);
-        cur_rx++;
+void loader_start(){
+    pthread_mutex_init(&loader.lock, NULL);
+    if (pthread_create(&loader.thread, NULL, loader_run, NULL) == 0) loader.running = 1;
+}
 
-        if (cur_rx > rx) return cx;
-    }
-    return cx;
+// Takes in the loader's progress, joining it once it is through the file
+void loader_poll(){
+    if (!loader.running) return;
+    pthread_mutex_lock(&loader.lock);
+    loader.seen = loader.loaded;
+    loader.seen_lines = loader.lines;
+    pthread_mutex_unlock(&loader.lock);
+    if (loader.seen < E.map_len) return;
+    pthread_join(loader.thread, NULL);
+    loader.running = 0;
 }
 
-void editor_update_row(Erow *row){
-    int tabs = 0;
-    int j;
-    for (j = 0; j < row->size; j++){
-        if (row->chars[j] == '\t') tabs++;
+// Rows in the buffer, with the lines the loader counted past the rows split
+// off the map so far. Exact once the loader is done, a lower bound before
+int64_t editor_total_rows(){
+    if (E.map_off >= E.map_len) return E.num_rows;
+    loader_poll();
+    int64_t rest = loader.seen_lines - E.map_lines;
+    if (loader.seen == E.map_len && E.map[E.map_len - 1] != '\n') rest++; // the last line has no newline
+    return E.num_rows + (rest > 0 ? rest : 0);
+}
+
+// Fills in a row for the line of the map at start, ending at its newline or
+// the end of the map, and returns where the next line starts
+char *editor_map_row(Erow *row, RopeNode *leaf, char *start){
+    char *end = E.map + E.map_len;
+    char *nl = memchr(start, '\n', end - start);
+    size_t len = nl ? (size_t)(nl - start) : (size_t)(end - start);
+    if (len > 0 && start[len - 1] == '\r') len--;
+
+    row->block = 0;
+    if (tindex.nblocks){
+        row->block = (start - E.map) / INDEX_BLOCK;
+        if (leaf->n == 1 || row->block < leaf->block_lo) leaf->block_lo = row->block;
+        if (leaf->n == 1 || row->block > leaf->block_hi) leaf->block_hi = row->block;
     }
+    row->size = len;
+    row->chars = start;
+    row->cap = 0;
+    row->view = NULL;
+    row->hl_state = 0;
+    row->hl_start = HL_STATE_NONE;
+    row->flags = ROW_MAPPED;
+    return nl ? nl + 1 : end;
+}
 
-    free(row->render);
-    row->render = malloc(row->size + tabs*(TAB_STOP-1) + 1);
+// Rows for the lines starting in [from, to) of the map, built by one thread
+// into leaves of their own
+typedef struct SplitJob{
+    char *from, *to;
+    RopeNode *first, *last; // chained, NULL if no line starts in the range
+    int64_t rows;
+    int64_t lines; // of the rows, the ones ended by a newline
+    char *end; // where the line after the last row starts
+}SplitJob;
+
+void editor_split_job(void *arg){
+    SplitJob *job = arg;
+    job->first = job->last = NULL;
+    job->rows = job->lines = 0;
+    char *start = job->from;
+    if (start > E.map + E.map_off){
+        // A line starts right after a newline, the one before from included
+        start = memchr(start - 1, '\n', job->to - start + 1);
+        start = start ? start + 1 : job->to;
+    }
+    RopeNode *leaf = NULL;
+    while (start < job->to){
+        if (leaf == NULL || leaf->n == ROPE_LEAF_ROWS){
+            RopeNode *next = rope_new_node(1);
+            if (leaf) leaf->next = next;
+            else job->first = next;
+            next->prev = leaf;
+            leaf = next;
+        }
+        Erow *row = &leaf->u.row[leaf->n++];
+        char *next = editor_map_row(row, leaf, start);
+        row->vlines = E.wrap ? editor_row_vlines(row) : 0;
+        leaf->rows++;
+        leaf->vlines += row->vlines;
+        job->rows++;
+        job->lines += next[-1] == '\n';
+        start = next;
+    }
+    job->last = leaf;
+    job->end = start;
+}
 
-    int idx = 0;
-    for (j = 0; j < row->size; j++){
-        if (row->chars[j] == '\t'){
-            row->render[idx++] = ' ';
-            while (idx % TAB_STOP != 0) row->render[idx++] = ' ';
-        }else{
-            row->render[idx++] = row->chars[j];
+// Links a chain of filled leaves in after the last one
+void rope_append_leaves(RopeNode *first){
+    RopeNode *last = rope_last_leaf();
+    if (last->n == 0 && last == E.root){
+        // An empty buffer's leaf makes way
+        free(last);
+        E.root = first;
+        first->prev = NULL;
+        last = first;
+        first = first->next;
+    }
+    while (first){
+        RopeNode *next = first->next;
+        last->next = first;
+        first->prev = last;
+        first->next = NULL;
+        if (last->parent){
+            rope_add_rows(last->parent, first->rows);
+            rope_add_vlines(last->parent, first->vlines);
         }
+        rope_insert_after(last, first);
+        last = first;
+        first = next;
     }
-    row->render[idx] = '\0';
-    row->rsize = idx;
+}
 
-    editor_update_syntax(row);
+// Splits the lines starting in the next SPLIT_WINDOW bytes of the map across
+// the work pool. Every thread looks for newlines in its own slice and builds
+// whole leaves of rows, which are linked onto the rope in file order
+void editor_split_window(){
+    SplitJob jobs[POOL_THREADS_MAX + 1];
+    int n = pool_threads() + 1, i;
+    size_t window = E.map_len - E.map_off < SPLIT_WINDOW ? E.map_len - E.map_off : SPLIT_WINDOW;
+    char *from = E.map + E.map_off;
+    for (i = 0; i < n; i++){
+        jobs[i].from = from + window * i / n;
+        jobs[i].to = from + window * (i + 1) / n;
+    }
+    pool_run(editor_split_job, jobs, sizeof(SplitJob), n);
+
+    for (i = 0; i < n; i++){
+        if (jobs[i].first == NULL) continue;
+        rope_append_leaves(jobs[i].first);
+        E.num_rows += jobs[i].rows;
+        E.map_lines += jobs[i].lines;
+        E.map_off = jobs[i].end - E.map;
+    }
 }
 
-void editor_insert_row(int at, char *s, size_t len){
-    if (at < 0 || at > E.num_rows) return;
+// Splits lines off the mapped file until row `upto` exists or the file runs out
+void editor_index_rows(int64_t upto){
+    while (upto - E.num_rows >= SPLIT_BULK_ROWS && E.map_off < E.map_len) editor_split_window();
+    while (E.num_rows <= upto && E.map_off < E.map_len){
+        Erow *row = rope_insert_row(E.num_rows);
+        E.num_rows++;
+        char *next = editor_map_row(row, rope_last_leaf(), E.map + E.map_off);
+        E.map_lines += next[-1] == '\n';
+        E.map_off = next - E.map;
+        editor_wrap_row(E.num_rows - 1);
+    }
+}
 
-    E.row = realloc(E.row, sizeof(Erow) * (E.num_rows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(Erow) * (E.num_rows - at));
-    for (int j = at + 1; j <= E.num_rows; j++) E.row[j].idx++;
+// Room for need bytes and half as many again, so a run of edits to one row
+// reallocates rarely
+int64_t editor_row_grow(int64_t need){
+    return need + need / 2 + 16;
+}
 
-    E.row[at].idx = at;
+// Short rows grow a slab size class at a time, which are that far apart already
+int64_t editor_row_cap(int64_t need){
+    return need <= SLAB_MAX ? (int64_t)slab_size(need) : editor_row_grow(need);
+}
 
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
+// Rows that came off the map get their own copy of chars before they are edited
+void editor_row_own(Erow *row){
+    if (!(row->flags & ROW_MAPPED)) return;
+    row->cap = editor_row_cap(row->size + 1);
+    char *chars = slab_alloc(row->cap);
+    memcpy(chars, row->chars, row->size);
+    chars[row->size] = '\0';
+    row->chars = chars;
+    row->flags &= ~ROW_MAPPED;
+}
 
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    E.row[at].hl = NULL;
-    E.row[at].hl_open_comment = 0;
-    editor_update_row(&E.row[at]);
+// Owned chars with room for size bytes and the '\0'
+void editor_row_reserve(Erow *row, int64_t size){
+    editor_row_own(row);
+    if (size + 1 <= row->cap) return;
+    int64_t cap = editor_row_cap(size + 1);
+    row->chars = slab_realloc(row->chars, row->cap, cap);
+    row->cap = cap;
+}
 
-    E.num_rows++;
-    E.dirty++;
+// The row's view, made on first use
+RowView *editor_row_view(Erow *row){
+    if (row->view == NULL){
+        row->view = slab_alloc(sizeof(RowView));
+        memset(row->view, 0, sizeof(RowView));
+        row->view->hl_len = -1;
+    }
+    return row->view;
 }
 
-void editor_free_row(Erow *row){
-    free(row->render);
-    free(row->chars);
-    free(row->hl);
+// Whether the row has render and hl, rows split off the map get them when
+// first drawn
+int editor_row_has_render(Erow *row){
+    return row->view && row->view->hl_len >= 0;
 }
 
-void editor_del_row(int at){
-    if (at < 0 || at >= E.num_rows) return;
-    editor_free_row(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(Erow) * (E.num_rows - at - 1));
-    for (int j = at; j < E.num_rows - 1; j++) E.row[j].idx--;
-    E.num_rows--;
-    E.dirty++;
+char *editor_row_render(Erow *row){
+    return row->view->render ? row->view->render : row->chars;
 }
 
-void editor_row_insert_char(Erow *row, int at, int c){
-    if (at < 0 || at > row->size) at = row->size;
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    row->size++;
-    row->chars[at] = c;
-    editor_update_row(row);
-    E.dirty++;
+//---highlight spans---
+// A row's hl is kept as runs of one highlight rather than a byte per column.
+// A run is a byte with the highlight in its low four bits and the length less
+// one in the high four, or 15 there and the length past 16 after it, seven
+// bits a byte with the top bit set on all but the last. Most lines of source
+// come to a few bytes and a line of plain text to one
+unsigned char *hl_buf; // a byte per column, for the lexer to fill and edits to patch
+int64_t hl_buf_cap;
+unsigned long hl_sets; // bumped each time a row's hl is set
+
+// Writes a run of n columns of highlight h and returns the bytes it took
+int hl_span_put(unsigned char *out, int64_t n, int h){
+    if (n <= 15){
+        out[0] = (n - 1) << 4 | h;
+        return 1;
+    }
+    int k = 0;
+    out[k++] = 0xf0 | h;
+    for (n -= 16; n >= 128; n >>= 7) out[k++] = (n & 127) | 128;
+    out[k++] = n;
+    return k;
 }
 
-void editor_row_appen_string(Erow *row, char *s, size_t len){
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    editor_update_row(row);
-    E.dirty++;
+// Reads the run at *off, moving *off past it, and returns its length
+int64_t hl_span_next(const unsigned char *spans, int64_t *off, int *h){
+    unsigned char b = spans[(*off)++];
+    *h = b & 15;
+    int64_t n = (b >> 4) + 1;
+    if (n == 16){
+        int shift = 0;
+        do{
+            b = spans[(*off)++];
+            n += (int64_t)(b & 127) << shift;
+            shift += 7;
+        }while (b & 128);
+    }
+    return n;
 }
 
-void editor_row_del_char(Erow *row, int at){
-    if (at < 0 || at > row->size) return;
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
-    editor_update_row(row);
-    E.dirty++;
+#define HL_INLINE ((int64_t)sizeof(unsigned char *))
+#define HL_PATCH_COLS 4096 // columns of hl either side of an edit unpacked to patch it
+
+unsigned char *editor_row_spans(RowView *v){
+    return v->hl_len <= HL_INLINE ? v->hl.in : v->hl.p;
 }
 
-//---editor opperations---
-void editor_insert_char(int c){
-    if (E.cy == E.num_rows){
-        editor_insert_row(E.num_rows, "", 0);
+// Goes on over the runs from byte off, which column *at starts, to the run
+// column col is in and returns its offset, with *at its first column. With
+// past the offset and column just after that run instead. A column past the
+// row gives its end
+int64_t hl_span_find(RowView *v, int64_t off, int64_t *at, int64_t col, int past){
+    const unsigned char *spans = editor_row_spans(v);
+    int h;
+    while (off < v->hl_len){
+        int64_t next = off;
+        int64_t n = hl_span_next(spans, &next, &h);
+        if (*at + n > col && !past) break;
+        off = next;
+        *at += n;
+        if (*at > col) break;
     }
-    editor_row_insert_char(&E.row[E.cy], E.cx, c);
-    E.cx++;
+    return off;
 }
 
-void editor_del_char() {
-    if (E.cy == E.num_rows) return;
-    if (E.cx == 0 && E.cy == 0) return;
+// The run last looked up, so drawing the screen lines of a wrapped row or
+// typing along a long one does not go over its runs from the start each time
+typedef struct HlSeek{
+    const unsigned char *hl;
+    unsigned long sets; // hl_sets when it was found
+    int64_t off;
+    int64_t col;
+}HlSeek;
+
+HlSeek hl_seek;
+
+// Offset of the run column col is in, and its first column in *at
+int64_t hl_span_seek(RowView *v, int64_t col, int64_t *at){
+    const unsigned char *spans = editor_row_spans(v);
+    int64_t off = 0;
+    *at = 0;
+    if (hl_seek.hl == spans && hl_seek.sets == hl_sets && hl_seek.col <= col){
+        off = hl_seek.off;
+        *at = hl_seek.col;
+    }
+    off = hl_span_find(v, off, at, col, 0);
+    hl_seek = (HlSeek){spans, hl_sets, off, *at};
+    return off;
+}
 
-    Erow *row = &E.row[E.cy];
-    if (E.cx > 0){
-        editor_row_del_char(row, E.cx - 1);
-        E.cx--;
-    }else{
-        E.cx = E.row[E.cy - 1].size;
-        editor_row_appen_string(&E.row[E.cy - 1], row->chars, row->size);
-        editor_del_row(E.cy);
-        E.cy--;
+// Room in hl_buf for n columns
+unsigned char *editor_hl_buf(int64_t n){
+    if (n > hl_buf_cap){
+        hl_buf_cap = editor_row_grow(n);
+        hl_buf = realloc(hl_buf, hl_buf_cap);
+        if (hl_buf == NULL) die("realloc");
     }
+    return hl_buf;
 }
 
-void editor_insert_new_line(){
-    if (E.cx == 0){
-        editor_insert_row(E.cy, "", 0);
+// The row's runs from byte off to end, a byte per render column
+void editor_row_unpack_hl(Erow *row, int64_t off, int64_t end, unsigned char *hl){
+    const unsigned char *spans = editor_row_spans(row->view);
+    int h;
+    while (off < end){
+        int64_t n = hl_span_next(spans, &off, &h);
+        memset(hl, h, n);
+        hl += n;
+    }
+}
+
+// Puts k bytes of runs in place of the row's bytes [off0, off1)
+void editor_row_put_hl(Erow *row, int64_t off0, int64_t off1, const unsigned char *spans, int64_t k){
+    RowView *v = editor_row_view(row);
+    unsigned char *old = editor_row_spans(v);
+    int64_t old_len = v->hl_len < 0 ? 0 : v->hl_len;
+    int64_t len = off0 + k + old_len - off1;
+    int was_in = old_len <= HL_INLINE, is_in = len <= HL_INLINE;
+    if (was_in == is_in && (is_in || slab_size(len) == slab_size(old_len))){
+        memmove(&old[off0 + k], &old[off1], old_len - off1);
+        memcpy(&old[off0], spans, k);
     }else{
-        Erow *row = &E.row[E.cy];
-        editor_insert_row(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-        row = &E.row[E.cy];
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        editor_update_row(row);
+        unsigned char in[HL_INLINE];
+        unsigned char *to = is_in ? in : slab_alloc(slab_size(len));
+        memcpy(to, old, off0);
+        memcpy(&to[off0], spans, k);
+        memcpy(&to[off0 + k], &old[off1], old_len - off1);
+        if (!was_in) slab_free(v->hl.p, slab_size(old_len));
+        if (is_in) memcpy(v->hl.in, in, len);
+        else v->hl.p = to;
     }
-    E.cy++;
-    E.cx = 0;
+    v->hl_len = len;
+    hl_sets++;
+}
 
-    Erow *row = &E.row[E.cy - 1];
-    int indent = 0;
-    while (indent < row->size && (row->chars[indent] == '\t' || row->chars[indent] == ' ')){
-        editor_insert_char(row->chars[indent]);
-        indent++;
+// Packs n columns of hl, a byte each, into runs in place of the row's bytes
+// [off0, off1). A run never takes more bytes than it has columns, so hl is
+// packed over itself
+void editor_row_pack_hl(Erow *row, int64_t off0, int64_t off1, unsigned char *hl, int64_t n){
+    int64_t k = 0, i = 0;
+    while (i < n){
+        int64_t j = i + 1;
+        while (j < n && hl[j] == hl[i]) j++;
+        k += hl_span_put(&hl[k], j - i, hl[i]);
+        i = j;
     }
+    editor_row_put_hl(row, off0, off1, hl, k);
 }
 
-//---file i/o---
+// Sets the whole of the row's hl from a byte per render column, or to plain
+// with hl NULL
+void editor_row_set_hl(Erow *row, unsigned char *hl){
+    RowView *v = editor_row_view(row);
+    int64_t old_len = v->hl_len < 0 ? 0 : v->hl_len;
+    if (hl){
+        editor_row_pack_hl(row, 0, old_len, hl, v->rsize);
+    }else{
+        unsigned char plain[16];
+        editor_row_put_hl(row, 0, old_len, plain, v->rsize ? hl_span_put(plain, v->rsize, HL_NORMAL) : 0);
+    }
+}
 
-char *editor_rows_to_string(int *buflen){
-    int totlen = 0;
-    int j;
-    for (j = 0; j < E.num_rows; j++){
-        totlen += E.row[j].size + 1;
+//---trigram index---
+unsigned int index_hash(unsigned int tri){
+    unsigned int h = tri * 2654435761u;
+    return h ^ (h >> 16);
+}
+
+void index_grow(){
+    unsigned int size = tindex.slot ? (tindex.mask + 1) * 2 : 4096;
+    Posting *slot = malloc(sizeof(Posting) * size);
+    if (slot == NULL) die("malloc");
+    unsigned int i;
+    for (i = 0; i < size; i++) slot[i].tri = TRIGRAM_NONE;
+    for (i = 0; tindex.slot && i <= tindex.mask; i++){
+        if (tindex.slot[i].tri == TRIGRAM_NONE) continue;
+        unsigned int h = index_hash(tindex.slot[i].tri) & (size - 1);
+        while (slot[h].tri != TRIGRAM_NONE) h = (h + 1) & (size - 1);
+        slot[h] = tindex.slot[i];
     }
-    *buflen = totlen;
+    free(tindex.slot);
+    tindex.slot = slot;
+    tindex.mask = size - 1;
+}
 
-    char *buf = malloc(totlen);
-    char *p = buf;
-    for(j = 0; j < E.num_rows; j++){
-        memcpy(p, E.row[j].chars, E.row[j].size);
-        p += E.row[j].size;
-        *p = '\n';
-        p++;
+// The postings of tri, NULL if it has none and add is 0
+Posting *index_posting(unsigned int tri, int add){
+    if (add && (tindex.used + 1) * 2 > (int)(tindex.mask + 1)) index_grow();
+    if (tindex.slot == NULL) return NULL;
+    unsigned int h = index_hash(tri) & tindex.mask;
+    while (tindex.slot[h].tri != tri){
+        if (tindex.slot[h].tri == TRIGRAM_NONE){
+            if (!add) return NULL;
+            Posting *p = &tindex.slot[h];
+            p->tri = tri;
+            p->len = p->cap = 0;
+            p->block = NULL;
+            tindex.used++;
+            return p;
+        }
+        h = (h + 1) & tindex.mask;
     }
+    return &tindex.slot[h];
+}
 
-    return buf;
+// First position in p's blocks not below block
+int index_lower_bound(Posting *p, int from, int block){
+    int hi = p->len;
+    while (from < hi){
+        int mid = (from + hi) / 2;
+        if (p->block[mid] < block) from = mid + 1;
+        else hi = mid;
+    }
+    return from;
+}
+
+void index_post(unsigned int tri, int block){
+    Posting *p = index_posting(tri, 1);
+    // The builder goes in block order, edits can land anywhere
+    int i = (p->len == 0 || p->block[p->len - 1] < block) ? p->len : index_lower_bound(p, 0, block);
+    if (i < p->len && p->block[i] == block) return;
+    if (p->len == p->cap){
+        p->cap = p->cap ? p->cap * 2 : 4;
+        p->block = realloc(p->block, sizeof(int) * p->cap);
+        if (p->block == NULL) die("realloc");
+    }
+    memmove(&p->block[i + 1], &p->block[i], sizeof(int) * (p->len - i));
+    p->block[i] = block;
+    p->len++;
+}
+
+// Runs on its own thread, posting the trigrams of the lines starting in each
+// block. Trigrams across a line ending are left out as no query holds one
+void *index_build(void *arg){
+    (void)arg;
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    const unsigned char *map = (const unsigned char *)E.map;
+    size_t len = E.map_len;
+    unsigned char *seen = calloc(1 << 21, 1); // a bit per trigram
+    if (seen == NULL) die("calloc");
+    unsigned int *tris = NULL;
+    size_t tris_cap = 0;
+    tindex.start[0] = 0;
+    int k;
+    for (k = 0; k < tindex.nblocks; k++){
+        size_t from = tindex.start[k], to = len;
+        size_t next = (size_t)(k + 1) * INDEX_BLOCK;
+        if (next >= len){
+            to = len;
+        }else if (from >= next){
+            to = from; // a long line runs through the whole block
+        }else{
+            const unsigned char *nl = memchr(map + next - 1, '\n', len - next + 1);
+            to = nl ? (size_t)(nl - map) + 1 : len;
+        }
+
+        if (to - from > tris_cap && tris_cap < (1 << 24)){
+            tris_cap = to - from < (1 << 24) ? to - from : (1 << 24);
+            free(tris);
+            tris = malloc(sizeof(unsigned int) * tris_cap);
+            if (tris == NULL) die("malloc");
+        }
+        size_t n = 0, i;
+        int lines = 0, run = 0;
+        unsigned int t = 0;
+        for (i = from; i < to; i++){
+            if (map[i] == '\n'){
+                lines++;
+                run = 0;
+                continue;
+            }
+            t = ((t << 8) | map[i]) & 0xffffff;
+            if (++run < 3 || (seen[t >> 3] & (1 << (t & 7)))) continue;
+            seen[t >> 3] |= 1 << (t & 7);
+            tris[n++] = t;
+        }
+        for (i = 0; i < n; i++){
+            index_post(tris[i], k);
+            seen[tris[i] >> 3] &= ~(1 << (tris[i] & 7));
+        }
+        tindex.lines[k] = lines;
+        tindex.start[k + 1] = to;
+
+        if (k + 1 == tindex.nblocks){
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            tindex.build_time = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        }
+        pthread_mutex_lock(&tindex.lock);
+        tindex.built = k + 1;
+        pthread_mutex_unlock(&tindex.lock);
+    }
+    free(tris);
+    free(seen);
+    return NULL;
+}
+
+// Starts building the index of a freshly mapped file in the background
+void index_start(){
+    if (E.map_len < INDEX_MIN_BYTES) return;
+    tindex.nblocks = (E.map_len + INDEX_BLOCK - 1) / INDEX_BLOCK;
+    tindex.start = malloc(sizeof(size_t) * (tindex.nblocks + 1));
+    tindex.lines = malloc(sizeof(int) * tindex.nblocks);
+    if (tindex.start == NULL || tindex.lines == NULL) die("malloc");
+    pthread_mutex_init(&tindex.lock, NULL);
+    if (pthread_create(&tindex.thread, NULL, index_build, NULL) != 0){
+        free(tindex.start);
+        free(tindex.lines);
+        tindex.nblocks = 0;
+    }
+}
+
+// Whether the index can be used, taking it over from the builder once it is done
+int index_ready(){
+    if (tindex.ready || tindex.nblocks == 0) return tindex.ready;
+    pthread_mutex_lock(&tindex.lock);
+    int done = tindex.built == tindex.nblocks;
+    pthread_mutex_unlock(&tindex.lock);
+    if (!done) return 0;
+
+    pthread_join(tindex.thread, NULL);
+    int i;
+    for (i = 0; i < tindex.npending; i++){
+        index_post(tindex.pending[2 * i + 1], tindex.pending[2 * i]);
+    }
+    free(tindex.pending);
+    tindex.pending = NULL;
+    tindex.npending = tindex.pending_cap = 0;
+    tindex.ready = 1;
+    return 1;
+}
+
+// Posts the trigrams of row `at` that overlap bytes from..to, which an edit
+// just wrote, under the row's block
+void index_add_row(int64_t at, int64_t from, int64_t to){
+    if (tindex.nblocks == 0) return;
+    Erow *row = editor_row(at);
+    int ready = index_ready();
+
+    from = from > 2 ? from - 2 : 0;
+    to = to + 2 < row->size ? to + 2 : row->size;
+    unsigned int t = 0;
+    int64_t i;
+    for (i = from; i < to; i++){
+        t = ((t << 8) | (unsigned char)row->chars[i]) & 0xffffff;
+        if (i < from + 2) continue;
+        if (ready){
+            index_post(t, row->block);
+            continue;
+        }
+        if (tindex.npending == tindex.pending_cap){
+            tindex.pending_cap = tindex.pending_cap ? tindex.pending_cap * 2 : 256;
+            tindex.pending = realloc(tindex.pending, sizeof(unsigned int) * 2 * tindex.pending_cap);
+            if (tindex.pending == NULL) die("realloc");
+        }
+        tindex.pending[2 * tindex.npending] = row->block;
+        tindex.pending[2 * tindex.npending + 1] = t;
+        tindex.npending++;
+    }
+}
+
+// Marks the blocks that may hold q, NULL when q is too short to look up or
+// the index isn't ready. The rarest trigram's blocks are narrowed by the rest
+unsigned char *index_candidates(const char *q, size_t m){
+    if (m < 3 || !index_ready()) return NULL;
+    unsigned char *cand = calloc(tindex.nblocks, 1);
+    Posting **post = malloc(sizeof(Posting *) * (m - 2));
+    if (cand == NULL || post == NULL) die("malloc");
+    Posting *rarest = NULL;
+    size_t i;
+    for (i = 0; i + 2 < m; i++){
+        unsigned int t = ((unsigned char)q[i] << 16) | ((unsigned char)q[i + 1] << 8) | (unsigned char)q[i + 2];
+        post[i] = index_posting(t, 0);
+        if (post[i] == NULL){
+            free(post);
+            return cand;
+        }
+        if (rarest == NULL || post[i]->len < rarest->len) rarest = post[i];
+    }
+
+    int n = rarest->len, j;
+    int *block = malloc(sizeof(int) * n);
+    if (block == NULL) die("malloc");
+    memcpy(block, rarest->block, sizeof(int) * n);
+    for (i = 0; i + 2 < m && n > 0; i++){
+        if (post[i] == rarest) continue;
+        int kept = 0, at = 0;
+        for (j = 0; j < n; j++){
+            at = index_lower_bound(post[i], at, block[j]);
+            if (at == post[i]->len) break;
+            if (post[i]->block[at] == block[j]) block[kept++] = block[j];
+        }
+        n = kept;
+    }
+    for (j = 0; j < n; j++) cand[block[j]] = 1;
+    free(block);
+    free(post);
+    return cand;
+}
+
+// Gives a row just inserted at `at` the first block of its leaf and posts it all
+void index_new_row(int64_t at){
+    if (tindex.nblocks == 0) return;
+    int off;
+    RopeNode *leaf = rope_find(at, &off);
+    leaf->u.row[off].block = leaf->block_lo;
+    index_add_row(at, 0, leaf->u.row[off].size);
+}
+
+int index_leaf_candidate(RopeNode *leaf, const unsigned char *cand){
+    int b;
+    for (b = leaf->block_lo; b <= leaf->block_hi; b++){
+        if (cand[b]) return 1;
+    }
+    return 0;
+}
+
+//---syntax highlighting---
+int is_separator(int c){
+    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[]{}:;", c) != NULL;
+}
+
+unsigned int keyword_hash(unsigned int seed, const char *s, int len){
+    unsigned int h = seed;
+    int i;
+    for (i = 0; i < len; i++) h = (h ^ (unsigned char)s[i]) * 16777619u;
+    return h;
+}
+
+// Parses the `|` suffixes once and searches for a seed that gives every
+// keyword its own slot, doubling the table until one does
+KeywordTable *editor_compile_keywords(char **keywords){
+    KeywordTable *kt = calloc(1, sizeof(KeywordTable));
+    if (kt == NULL) die("calloc");
+    int n = 0;
+    while (keywords[n]) n++;
+
+    int c;
+    for (c = 0; c < 256; c++) kt->sep[c] = is_separator(c) != 0;
+
+    unsigned int size = 4;
+    while (size < (unsigned int)n * 2) size <<= 1;
+
+    while (1){
+        kt->slot = calloc(size, sizeof(KeywordSlot));
+        if (kt->slot == NULL) die("calloc");
+        kt->mask = size - 1;
+        for (kt->seed = 2166136261u; kt->seed < 2166136261u + 256; kt->seed++){
+            int j;
+            for (j = 0; j < n; j++){
+                int klen = strlen(keywords[j]);
+                int kw2 = keywords[j][klen - 1] == '|';
+                if (kw2) klen--;
+
+                KeywordSlot *slot = &kt->slot[keyword_hash(kt->seed, keywords[j], klen) & kt->mask];
+                if (slot->word) break;
+                slot->word = keywords[j];
+                slot->len = klen;
+                slot->hl = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+                if (klen > kt->max_len) kt->max_len = klen;
+            }
+            if (j == n) return kt;
+            memset(kt->slot, 0, size * sizeof(KeywordSlot));
+            kt->max_len = 0;
+        }
+        free(kt->slot);
+        size <<= 1;
+    }
+}
+
+void editor_free_keywords(KeywordTable *kt){
+    if (kt == NULL) return;
+    free(kt->slot);
+    free(kt);
+}
+
+// Keyword class of the word starting at s, HL_NORMAL if it isn't one
+int editor_match_keyword(KeywordTable *kt, const char *s, int64_t len, int *klen){
+    unsigned int h = kt->seed;
+    int i;
+    for (i = 0; i < len && !kt->sep[(unsigned char)s[i]]; i++){
+        if (i == kt->max_len) return HL_NORMAL;
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+    }
+
+    KeywordSlot *slot = &kt->slot[h & kt->mask];
+    if (slot->word == NULL || slot->len != i || memcmp(slot->word, s, i)) return HL_NORMAL;
+    *klen = i;
+    return slot->hl;
+}
+
+// Highlights len bytes of s starting in lexer `state` and returns the state at
+// the end. With hl NULL only the state is tracked, which is all rows above the
+// viewport need. With settle >= 0 hl holds an older highlight that is right
+// from byte settle on, and the lexer returns -1 once it is back in step with it.
+// The syntax is passed in, the highlight worker lexes while E may change
+int editor_lex(EditorSyntax *syntax, const char *s, int64_t len, int state, unsigned char *hl, int64_t settle){
+    if (syntax == NULL){
+        if (hl) memset(hl, HL_NORMAL, len);
+        return 0;
+    }
+
+    KeywordTable *keywords = syntax->keyword_table;
+
+    char *scs = syntax->single_line_comment_start;
+    char *mcs = syntax->multiline_comment_start;
+    char *mce = syntax->multiline_comment_end;
+
+    int scs_len = scs ? strlen(scs) : 0;
+    int mcs_len = mcs ? strlen(mcs) : 0;
+    int mce_len = mce ? strlen(mce) : 0;
+
+    int prev_sep = 1;
+    int in_string = 0; // strings end with their row
+    int in_comment = state & HL_STATE_COMMENT;
+
+    int64_t i = 0, last = -1;
+    unsigned char last_hl = HL_NORMAL; // old hl of byte last
+    while (i < len){
+        char c = s[i];
+        unsigned char prev_hl = (hl && i > 0) ? hl[i - 1] : HL_NORMAL;
+
+        // A plain separator before i, in the new and the old highlight alike,
+        // leaves the lexer in the one state it can be in between tokens
+        if (settle >= 0 && i > settle){
+            if (last == i - 1 && last_hl == HL_NORMAL && prev_hl == HL_NORMAL &&
+                keywords->sep[(unsigned char)s[i - 1]]) return -1;
+        }
+        if (settle >= 0 && i >= settle){
+            last = i;
+            last_hl = hl[i];
+        }
+
+        // Comments
+        if (scs_len && !in_string && !in_comment){
+            if (i + scs_len <= len && !memcmp(s + i, scs, scs_len)){
+                if (hl) memset(hl + i, HL_COMMENT, len - i);
+                break;
+            }
+        }
+
+        if (mcs_len && mce_len && !in_string){
+            if (in_comment){
+                if (hl) hl[i] = HL_MLCOMMENT;
+                if (i + mce_len <= len && !memcmp(&s[i], mce, mce_len)){
+                    if (hl) memset(&hl[i], HL_MLCOMMENT, mce_len);
+                    i += mce_len;
+                    in_comment = 0;
+                    prev_sep = 1;
+                    continue;
+                } else{
+                    i++;
+                    continue;
+                }
+            } else if (i + mcs_len <= len && !memcmp(&s[i], mcs, mcs_len)){
+                if (hl) memset(&hl[i], HL_MLCOMMENT, mcs_len);
+                i += mcs_len;
+                in_comment = 1;
+                continue;
+            }
+        }
+
+
+        // Strings
+        if (syntax->flags & HL_HIGHLIGHT_STRINGS){
+            if (in_string){
+                if (hl) hl[i] = HL_STRING;
+                if (c == '\\' && i + 1 < len){
+                    if (hl) hl[i + 1] = HL_STRING;
+                    i += 2;
+                    continue;
+                }
+                if (c == in_string) in_string = 0;
+                i++;
+                prev_sep = 1;
+                continue;
+            }else{
+                if (c == '"' || c == '\''){
+                    in_string = c;
+                    if (hl) hl[i] = HL_STRING;
+                    i++;
+                    continue;
+                }
+            }
+        }
+
+        if (hl == NULL){
+            i++;
+            continue;
+        }
+
+        // Numbers
+        if (syntax->flags & HL_HIGHLIGHT_NUMBERS){
+            if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
+                (c == '.' && prev_hl == HL_NUMBER)){
+                hl[i] = HL_NUMBER;
+                i++;
+                prev_sep = 0;
+                continue;
+            }
+        }
+
+        if (prev_sep){
+            int klen;
+            int kw = editor_match_keyword(keywords, &s[i], len - i, &klen);
+            if (kw != HL_NORMAL){
+                memset(&hl[i], kw, klen);
+                i += klen;
+                prev_sep = 0;
+                continue;
+            }
+        }
+
+        hl[i] = HL_NORMAL;
+        prev_sep = keywords->sep[(unsigned char)c];
+        i++;
+    }
+
+    return in_comment ? HL_STATE_COMMENT : 0;
+}
+
+int64_t editor_hl_dirty(){
+    return E.hl_ndirty ? E.hl_dirty[E.hl_ndirty - 1] : HL_CLEAN;
+}
+
+// Marks rows from `at` on as possibly stale. Every mark is kept, a relex that
+// settles above one can't vouch for the rows past it
+void editor_hl_mark_dirty(int64_t at){
+    if (E.syntax == NULL) return; // nothing to relex, picking a syntax starts over
+    E.hl_gen++;
+    int i;
+    for (i = 0; i < E.hl_ndirty; i++){
+        if (E.hl_dirty[i] == at) return;
+        if (E.hl_dirty[i] < at) break;
+    }
+
+    if (E.hl_ndirty == HL_DIRTY_MAX){
+        // Out of marks, forget every checkpoint past the deepest one instead
+        int off;
+        int64_t forget = i == 0 ? at : E.hl_dirty[0];
+        if (hl.frontier > forget) hl.frontier = forget;
+        RopeNode *leaf = rope_find(forget, &off);
+        for (; leaf; leaf = leaf->next, off = 0){
+            for (; off < leaf->n; off++) leaf->u.row[off].hl_state &= ~HL_STATE_KNOWN;
+        }
+        if (i == 0) return;
+        E.hl_ndirty--;
+        memmove(&E.hl_dirty[0], &E.hl_dirty[1], sizeof(int64_t) * E.hl_ndirty);
+        i--;
+    }
+
+    memmove(&E.hl_dirty[i + 1], &E.hl_dirty[i], sizeof(int64_t) * (E.hl_ndirty - i));
+    E.hl_dirty[i] = at;
+    E.hl_ndirty++;
+}
+
+// Row `at`, the lowest mark, has just been relexed from a trusted start. If it
+// ended differently the stale run moves down a row, merging into the next mark
+void editor_hl_settle(int64_t at, int converged){
+    E.hl_ndirty--;
+    if (!converged && editor_hl_dirty() > at + 1) E.hl_dirty[E.hl_ndirty++] = at + 1;
+}
+
+// Keeps the marks, and the worker's frontier, on the same rows when a row is
+// inserted or deleted at `at`
+void editor_hl_shift(int64_t at, int delta){
+    E.hl_gen++;
+    if (hl.frontier > at) hl.frontier += delta;
+    int i, n = 0;
+    for (i = 0; i < E.hl_ndirty; i++){
+        int64_t mark = E.hl_dirty[i];
+        if (mark > at || (delta > 0 && mark == at)) mark += delta;
+        if (n == 0 || E.hl_dirty[n - 1] != mark) E.hl_dirty[n++] = mark;
+    }
+    E.hl_ndirty = n;
+}
+
+// Lexer state at the end of row `at`. Every row keeps its end state as a
+// checkpoint, so this resumes from the nearest trusted row above and stops
+// early once a relexed row ends the same way it did before
+int editor_hl_state(int64_t at){
+    if (at < 0 || E.syntax == NULL) return 0;
+
+    while (1){
+        int off;
+        RopeNode *leaf = rope_find(at, &off);
+        int64_t from = at;
+        while (from >= 0){
+            Erow *row = &leaf->u.row[off];
+            if ((row->hl_state & HL_STATE_KNOWN) && from < editor_hl_dirty()) break;
+            from--;
+            if (--off < 0 && leaf->prev){
+                leaf = leaf->prev;
+                off = leaf->n - 1;
+            }
+        }
+        int state = (from >= 0) ? leaf->u.row[off].hl_state & ~HL_STATE_KNOWN : 0;
+        if (from == at) return state;
+
+        if (from < 0){
+            leaf = rope_first_leaf();
+            off = 0;
+        }else if (++off == leaf->n){
+            leaf = leaf->next;
+            off = 0;
+        }
+
+        int converged = 0;
+        int64_t j;
+        for (j = from + 1; j <= at; j++){
+            Erow *row = &leaf->u.row[off];
+            int end = editor_lex(E.syntax, row->chars, row->size, state, NULL, -1) | HL_STATE_KNOWN;
+            if (j == editor_hl_dirty()){
+                converged = (end == row->hl_state);
+                editor_hl_settle(j, converged);
+            }
+            row->hl_state = end;
+            state = end & ~HL_STATE_KNOWN;
+            if (converged) break; // known rows past here are right again
+            if (++off == leaf->n){
+                leaf = leaf->next;
+                off = 0;
+            }
+        }
+        if (converged) continue;
+        if (from < hl.frontier && at >= hl.frontier && editor_hl_dirty() > at) hl.frontier = at + 1;
+        return state;
+    }
+}
+
+// Row `at` was just highlighted through to its end, in state end
+void editor_hl_row_end(int64_t at, Erow *row, int end){
+    if (editor_hl_dirty() == at){
+        editor_hl_settle(at, end == row->hl_state);
+    }else if (end != row->hl_state){
+        editor_hl_mark_dirty(at + 1); // rows below pick the change up as they are drawn
+    }
+    row->hl_state = end;
+}
+
+void editor_update_syntax(int64_t at){
+    Erow *row = editor_row(at);
+    if (!editor_row_has_render(row)) return; // highlighted when it is first drawn
+    if (!editor_hl_near(at)){
+        // Edited too far down to lex now. Plain until the worker has the state
+        // above, which looks at this row again if it had been through it
+        editor_row_set_hl(row, NULL);
+        row->hl_start = HL_STATE_NONE;
+        if (row->hl_state & HL_STATE_KNOWN) editor_hl_mark_dirty(at);
+        return;
+    }
+
+    int start = editor_hl_state(at - 1);
+    unsigned char *hl = editor_hl_buf(row->view->rsize);
+    int end = editor_lex(E.syntax, editor_row_render(row), row->view->rsize, start, hl, -1) | HL_STATE_KNOWN;
+    editor_row_set_hl(row, hl);
+    row->hl_start = start;
+    editor_hl_row_end(at, row, end);
+}
+
+int editor_syntax_to_color(int hl){
+    switch (hl){
+        case HL_MLCOMMENT:
+        case HL_COMMENT: return 36;
+		case HL_KEYWORD1: return 33;
+		case HL_KEYWORD2: return 32;       
+		case HL_STRING: return 35;
+        case HL_NUMBER: return 31;
+        case HL_MATCH: return 34;
+        default: return 37;
+    }
+}
+
+void editor_select_syntax_highlight(){
+    E.syntax = NULL;
+    if (E.filename == NULL) return;
+
+    char *ext = strrchr(E.filename, '.');
+    unsigned int j;
+    for (j = 0; j < HLDB_ENTRIES; j++){
+        EditorSyntax *s = &HLDB[j];
+        unsigned int i = 0;
+        while (s->filematch[i]){
+            int is_ext = (s->filematch[i][0] == '.');
+            if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+                (!is_ext && strstr(E.filename, s->filematch[i]))) {
+                E.syntax = s;     
+                if (s->keyword_table == NULL) s->keyword_table = editor_compile_keywords(s->keywords);
+
+                // Forget every checkpoint, rows relex as they are drawn
+                RopeNode *leaf;
+                for (leaf = rope_first_leaf(); leaf; leaf = leaf->next){
+                    int j;
+                    for (j = 0; j < leaf->n; j++){
+                        leaf->u.row[j].hl_state = 0;
+                        leaf->u.row[j].hl_start = HL_STATE_NONE;
+                    }
+                }
+                E.hl_ndirty = 0;
+                E.hl_gen++;
+                hl.frontier = 0;
+
+                return;
+            }
+            i++;
+        }
+    }
+}
+
+//---highlight worker---
+// First row whose end state is not to be trusted yet
+int64_t hl_next(){
+    int64_t dirty = editor_hl_dirty();
+    return hl.frontier < dirty ? hl.frontier : dirty;
+}
+
+// Lets the worker have the lock, waking it if there are rows for it
+void hl_release(){
+    if (E.syntax && hl_next() < E.num_rows) pthread_cond_signal(&hl.work);
+    pthread_mutex_unlock(&hl.lock);
+}
+
+// Whether the lexer state above row `at` is close enough to the trusted rows
+// to lex on the spot. If not the worker is left to it, and pokes the screen
+// once it is done
+int editor_hl_near(int64_t at){
+    if (!hl.running || E.syntax == NULL || at - hl_next() <= HL_SYNC_ROWS) return 1;
+    if (at > hl.want) hl.want = at;
+    return 0;
+}
+
+// Stores the end states the worker lexed for the n rows from `from` on, the
+// way editor_hl_state does, and moves the frontier past them
+void hl_publish(int64_t from, int n, const unsigned char *ends){
+    int off;
+    RopeNode *leaf = rope_find(from, &off);
+    int64_t j;
+    for (j = from; j < from + n; j++){
+        Erow *row = &leaf->u.row[off];
+        int converged = 0;
+        if (j == editor_hl_dirty()){
+            converged = (ends[j - from] == row->hl_state);
+            editor_hl_settle(j, converged);
+        }
+        row->hl_state = ends[j - from];
+        if (converged) break; // known rows past here are right again
+        if (++off == leaf->n){
+            leaf = leaf->next;
+            off = 0;
+        }
+    }
+    if (j == from + n) j--;
+    if (editor_hl_dirty() > j && hl.frontier <= j) hl.frontier = j + 1;
+}
+
+void *hl_work(void *arg){
+    (void)arg;
+    static int64_t len[HL_BATCH_ROWS];
+    static unsigned char ends[HL_BATCH_ROWS];
+    char *buf = NULL;
+    size_t cap = 0;
+
+    pthread_mutex_lock(&hl.lock);
+    while (1){
+        int64_t from = hl_next();
+        if (E.syntax == NULL || from >= E.num_rows){
+            pthread_cond_wait(&hl.work, &hl.lock);
+            continue;
+        }
+
+        // Copy the batch out, its rows may change or go once the lock is let go
+        int state = from ? editor_row(from - 1)->hl_state & ~HL_STATE_KNOWN : 0;
+        int off;
+        RopeNode *leaf = rope_find(from, &off);
+        size_t used = 0;
+        int i, n = 0;
+        while (leaf && n < HL_BATCH_ROWS && used < HL_BATCH_BYTES){
+            Erow *row = &leaf->u.row[off];
+            if (used + row->size > cap){
+                cap = editor_row_grow(used + row->size);
+                buf = realloc(buf, cap);
+                if (buf == NULL) die("realloc");
+            }
+            memcpy(&buf[used], row->chars, row->size);
+            used += row->size;
+            len[n++] = row->size;
+            if (++off == leaf->n){
+                leaf = leaf->next;
+                off = 0;
+            }
+        }
+        EditorSyntax *syntax = E.syntax;
+        unsigned long gen = E.hl_gen;
+        pthread_mutex_unlock(&hl.lock);
+
+        const char *p = buf;
+        for (i = 0; i < n; i++){
+            state = editor_lex(syntax, p, len[i], state, NULL, -1);
+            ends[i] = state | HL_STATE_KNOWN;
+            p += len[i];
+        }
+
+        pthread_mutex_lock(&hl.lock);
+        if (gen != E.hl_gen || syntax != E.syntax){
+            hl.discarded++; // lexed from text an edit has since changed
+            continue;
+        }
+        hl_publish(from, n, ends);
+        hl.batches++;
+        if (hl.want >= 0 && hl_next() > hl.want){
+            hl.want = -1;
+            input_poke();
+        }
+    }
+    return NULL;
+}
+
+// Starts the worker. The main thread holds the lock from here on, letting go
+// of it only while it waits for input
+void hl_start(){
+    pthread_mutex_init(&hl.lock, NULL);
+    pthread_cond_init(&hl.work, NULL);
+    pthread_mutex_lock(&hl.lock);
+    if (pthread_create(&hl.thread, NULL, hl_work, NULL) != 0){
+        pthread_mutex_unlock(&hl.lock); // every row is lexed on the main thread
+        return;
+    }
+    hl.running = 1;
+}
+
+//---row opperations---
+// Column after chars [from, to) when they start at column rx, jumping from tab
+// to tab
+int64_t editor_row_width(Erow *row, int64_t from, int64_t to, int64_t rx){
+    const char *p = &row->chars[from], *end = &row->chars[to], *tab;
+    while ((tab = memchr(p, '\t', end - p)) != NULL){
+        rx += tab - p;
+        rx += TAB_STOP - rx % TAB_STOP;
+        p = tab + 1;
+    }
+    return rx + (end - p);
+}
+
+// Screen lines a row takes when wrapped, at least one
+int editor_row_vlines(Erow *row){
+    int64_t width = editor_row_has_render(row) ? row->view->rsize : editor_row_width(row, 0, row->size, 0);
+    return width ? (width + E.screen_cols - 1) / E.screen_cols : 1;
+}
+
+// Recounts the screen lines of row `at` after it changed width
+void editor_wrap_row(int64_t at){
+    if (!E.wrap) return;
+    int off;
+    RopeNode *leaf = rope_find(at, &off);
+    Erow *row = &leaf->u.row[off];
+    int n = editor_row_vlines(row);
+    rope_add_vlines(leaf, n - row->vlines);
+    row->vlines = n;
+}
+
+// Counts the screen lines of every row again, for soft wrap being turned on
+// or off and the screen changing width
+int64_t editor_wrap_count(RopeNode *node){
+    node->vlines = 0;
+    int i;
+    for (i = 0; i < node->n; i++){
+        if (node->leaf){
+            Erow *row = &node->u.row[i];
+            row->vlines = E.wrap ? editor_row_vlines(row) : 0;
+            node->vlines += row->vlines;
+        }else{
+            node->vlines += editor_wrap_count(node->u.child[i]);
+        }
+    }
+    return node->vlines;
+}
+
+// Render column of char k * COL_CHECK. Long rows keep these checkpoints as
+// they are asked for and an edit drops the ones past it, so turning a char
+// into a column scans at most COL_CHECK chars
+int64_t editor_row_check(Erow *row, int64_t k){
+    RowView *v = editor_row_view(row);
+    RowCols *c = v->cols;
+    if (c == NULL || k >= c->cap){
+        int cap = editor_row_grow(k + 1);
+        c = realloc(c, sizeof(RowCols) + sizeof(int64_t) * cap);
+        if (c == NULL) die("realloc");
+        if (v->cols == NULL) c->n = 0;
+        c->cap = cap;
+        v->cols = c;
+    }
+    if (c->n == 0) c->col[c->n++] = 0;
+    while (c->n <= k){
+        int64_t at = (int64_t)c->n * COL_CHECK;
+        c->col[c->n] = editor_row_width(row, at - COL_CHECK, at, c->col[c->n - 1]);
+        c->n++;
+    }
+    return c->col[k];
+}
+
+// An edit at char at leaves the checkpoints up to it
+void editor_row_drop_checks(Erow *row, int64_t at){
+    RowCols *c = row->view ? row->view->cols : NULL;
+    if (c && c->n > at / COL_CHECK + 1) c->n = at / COL_CHECK + 1;
+}
+
+int64_t editor_row_cx_to_rx(Erow *row, int64_t cx){
+    if (row->size < COL_CHECK) return editor_row_width(row, 0, cx, 0);
+    int64_t k = cx / COL_CHECK;
+    return editor_row_width(row, k * COL_CHECK, cx, editor_row_check(row, k));
+}
+
+int64_t editor_row_rx_to_cx(Erow *row, int64_t rx){
+    int64_t cur_rx = 0;
+    int64_t cx = 0;
+    if (row->size >= COL_CHECK){
+        // Start from the last checkpoint at or before rx
+        int64_t lo = 0, hi = row->size / COL_CHECK;
+        editor_row_check(row, hi);
+        while (lo < hi){
+            int64_t mid = (lo + hi + 1) / 2;
+            if (row->view->cols->col[mid] <= rx) lo = mid;
+            else hi = mid - 1;
+        }
+        cx = lo * COL_CHECK;
+        cur_rx = row->view->cols->col[lo];
+    }
+    for (; cx < row->size; cx++){
+        if (row->chars[cx] == '\t')
+            cur_rx += (TAB_STOP - 1) - (cur_rx % TAB_STOP);
+        cur_rx++;
+
+        if (cur_rx > rx) return cx;
+    }
+    return cx;
+}
+
+// Room in render for rsize columns, or none if the row renders as its chars.
+// The first render is sized to fit, later ones leave slack for the row to
+// grow into
+void editor_row_reserve_render(Erow *row, int64_t rsize, int own){
+    RowView *v = editor_row_view(row);
+    if (!own){
+        slab_free(v->render, v->rcap);
+        v->render = NULL;
+        v->rcap = 0;
+        return;
+    }
+    if (v->render && rsize <= v->rcap) return;
+    int64_t rcap = v->render ? editor_row_cap(rsize) : (int64_t)slab_size(rsize);
+    v->render = slab_realloc(v->render, v->rcap, rcap);
+    v->rcap = rcap;
+}
+
+// Renders chars [from, to) starting at column rx and returns the column after
+int64_t editor_row_expand(Erow *row, int64_t from, int64_t to, int64_t rx){
+    char *render = row->view->render;
+    int64_t j;
+    for (j = from; j < to; j++){
+        if (row->chars[j] == '\t'){
+            render[rx++] = ' ';
+            while (rx % TAB_STOP != 0) render[rx++] = ' ';
+        }else{
+            render[rx++] = row->chars[j];
+        }
+    }
+    return rx;
+}
+
+// A row without tabs renders as its chars and keeps no copy of them
+void editor_render_row(int64_t at){
+    Erow *row = editor_row(at);
+    int own = memchr(row->chars, '\t', row->size) != NULL;
+    editor_row_drop_checks(row, 0);
+    editor_row_reserve_render(row, editor_row_width(row, 0, row->size, 0), own);
+    row->view->rsize = own ? editor_row_expand(row, 0, row->size, 0) : row->size;
+    editor_row_set_hl(row, NULL);
+    editor_wrap_row(at);
+}
+
+// Renders and highlights row `at` again after its chars changed
+void editor_update_row(int64_t at){
+    E.hl_gen++;
+    editor_render_row(at);
+    editor_update_syntax(at);
+}
+
+// Brings render and hl up to date after the row's chars from at on were
+// replaced, the first `added` of them new and the rest as they were. Columns before the edit are left alone,
+// the ones after it are shifted over unless a tab past the edit changes width,
+// and the lexer restarts between the tokens before the edit and stops once it
+// is back in step with the old hl
+void editor_row_patch(int64_t file_row, int64_t at, int64_t added){
+    Erow *row = editor_row(file_row);
+    E.hl_gen++;
+    editor_row_drop_checks(row, at);
+    if (!editor_row_has_render(row)){ // rendered when it is first drawn
+        editor_wrap_row(file_row);
+        return;
+    }
+    RowView *v = row->view;
+    if (v->render == NULL && memchr(&row->chars[at], '\t', added)){
+        editor_render_row(file_row); // the row needs a render of its own now
+        editor_update_syntax(file_row);
+        return;
+    }
+
+    // Past the first tab after the edit every column moved by the same whole
+    // tab stops, so from there the old render and hl only shift over
+    int64_t tail = at + added; // first char the edit left alone
+    char *tab = memchr(&row->chars[tail], '\t', row->size - tail);
+    int64_t keep = tab ? tab - row->chars + 1 : tail;
+    int64_t keep_width = editor_row_width(row, keep, row->size, 0);
+    int64_t old_end = v->rsize - keep_width;
+    int64_t rx = editor_row_cx_to_rx(row, at);
+    int64_t end = editor_row_width(row, at, keep, rx);
+    int own = v->render != NULL; // otherwise the chars are the render, already edited
+    int64_t old_rsize = v->rsize;
+    editor_row_reserve_render(row, end + keep_width, own);
+    if (own) memmove(&v->render[end], &v->render[old_end], keep_width);
+    if (own) editor_row_expand(row, at, keep, rx);
+    v->rsize = end + keep_width;
+    editor_wrap_row(file_row);
+    char *render = editor_row_render(row);
+
+    int near = editor_hl_near(file_row);
+    int start = near ? editor_hl_state(file_row - 1) : 0;
+    if (near && row->hl_start != start){
+        editor_update_syntax(file_row); // the rows above changed it too
+        return;
+    }
+    int64_t settle = end; // render column the old hl is right from
+    if (!(row->hl_state & HL_STATE_KNOWN) || editor_hl_dirty() <= file_row) settle = -1;
+
+    // Only the runs from HL_PATCH_COLS before the edit to HL_PATCH_COLS past
+    // it are unpacked, and the rest of the row too if the lexer is not back in
+    // step by then. w0 and w1 are the old columns they cover
+    int64_t w0, w1;
+    int64_t off0 = hl_span_seek(v, rx - HL_PATCH_COLS, &w0);
+    w1 = w0;
+    int64_t off1 = hl_span_find(v, off0, &w1, old_end + HL_PATCH_COLS, 1);
+    for (;;){
+        int64_t n = w1 - old_end + end - w0; // columns in the window after the edit
+        unsigned char *hl = editor_hl_buf(n > w1 - w0 ? n : w1 - w0);
+        editor_row_unpack_hl(row, off0, off1, hl);
+        memmove(&hl[end - w0], &hl[old_end - w0], w1 - old_end);
+
+        if (!near || E.syntax == NULL){
+            memset(&hl[rx - w0], HL_NORMAL, end - rx);
+            editor_row_pack_hl(row, off0, off1, hl, n);
+            if (!near){
+                // The old hl stays on around the edit until the worker gets here
+                row->hl_start = HL_STATE_NONE;
+                if (row->hl_state & HL_STATE_KNOWN) editor_hl_mark_dirty(file_row);
+            }
+            return;
+        }
+
+        // Back up past any comment opener the edit could complete and to a
+        // separator the old hl left plain, where the lexer holds no state
+        char *scs = E.syntax->single_line_comment_start;
+        char *mcs = E.syntax->multiline_comment_start;
+        int64_t back = scs ? (int64_t)strlen(scs) - 1 : 0;
+        if (mcs && (int64_t)strlen(mcs) - 1 > back) back = strlen(mcs) - 1;
+        int64_t from = rx - back;
+        unsigned char *sep = E.syntax->keyword_table->sep;
+        while (from > w0 && !(hl[from - 1 - w0] == HL_NORMAL && sep[(unsigned char)render[from - 1]])) from--;
+        if (from < 0) from = 0;
+
+        int backed = from > w0 || w0 == 0; // to a place the lexer can start from
+        if (backed){
+            int state = editor_lex(E.syntax, &render[from], w0 + n - from, from ? 0 : start, &hl[from - w0],
+                settle >= 0 ? settle - from : -1);
+            if (state == -1 || w0 + n == v->rsize){
+                editor_row_pack_hl(row, off0, off1, hl, n);
+                hl_seek = (HlSeek){editor_row_spans(v), hl_sets, off0, w0}; // the runs before are as they were
+                if (state == -1) return; // the rest of the row, and where it ends, are as they were
+                editor_hl_row_end(file_row, row, state | HL_STATE_KNOWN);
+                return;
+            }
+        }
+        if (!backed) w0 = off0 = 0;
+        w1 = old_rsize;
+        off1 = v->hl_len;
+    }
+}
+
+void editor_insert_row(int64_t at, char *s, size_t len){
+    if (at < 0 || at > E.num_rows) return;
+
+    undo_log(UNDO_INSERT_ROW, at, 0, s, len);
+    editor_hl_shift(at, 1);
+    Erow *row = rope_insert_row(at);
+    E.num_rows++;
+
+    row->size = len;
+    row->cap = slab_size(len + 1);
+    row->chars = slab_alloc(row->cap);
+    memcpy(row->chars, s, len);
+    row->chars[len] = '\0';
+
+    row->view = NULL;
+    row->hl_state = 0;
+    row->hl_start = HL_STATE_NONE;
+    row->flags = 0;
+    row->block = 0;
+    editor_update_row(at);
+    index_new_row(at);
+
+    E.dirty++;
+}
+
+// Brings render and hl up to date for a row about to be shown, rows split off
+// the map get them the first time they are needed
+Erow *editor_row_rendered(int64_t at){
+    Erow *row = editor_row(at);
+    int near = editor_hl_near(at);
+    if (!editor_row_has_render(row)){
+        editor_render_row(at);
+        if (near) editor_update_syntax(at); // otherwise plain until the worker has the state above
+    }else if (!near){
+        // Drawn with the hl it had until the worker has the state above
+    }else if (row->hl_start != editor_hl_state(at - 1)){
+        editor_update_syntax(at);
+    }
+    return row;
+}
+
+void editor_free_row(Erow *row){
+    RowView *v = row->view;
+    if (v){
+        slab_free(v->render, v->rcap);
+        if (v->hl_len > HL_INLINE) slab_free(v->hl.p, slab_size(v->hl_len));
+        free(v->cols);
+        slab_free(v, sizeof(RowView));
+    }
+    if (!(row->flags & ROW_MAPPED)) slab_free(row->chars, row->cap);
+}
+
+void editor_del_row(int64_t at){
+    if (at < 0 || at >= E.num_rows) return;
+    Erow *row = editor_row(at);
+    undo_log(UNDO_DELETE_ROW, at, 0, row->chars, row->size);
+    editor_free_row(row);
+    rope_delete_row(at);
+    E.num_rows--;
+    editor_hl_shift(at, -1);
+    editor_hl_mark_dirty(at); // the next row now starts where this one did
+    E.dirty++;
+}
+
+void editor_row_insert_string(int64_t file_row, int64_t at, const char *s, size_t len){
+    Erow *row = editor_row(file_row);
+    if (at < 0 || at > row->size) at = row->size;
+    undo_log(UNDO_INSERT, file_row, at, s, len);
+    editor_row_reserve(row, row->size + len);
+    memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+    memcpy(&row->chars[at], s, len);
+    row->size += len;
+    editor_row_patch(file_row, at, len);
+    index_add_row(file_row, at, at + len);
+    E.dirty++;
+}
+
+void editor_row_insert_char(int64_t file_row, int64_t at, int c){
+    char ch = c;
+    editor_row_insert_string(file_row, at, &ch, 1);
+}
+
+void editor_row_appen_string(int64_t file_row, char *s, size_t len){
+    editor_row_insert_string(file_row, editor_row(file_row)->size, s, len);
+}
+
+void editor_row_del_string(int64_t file_row, int64_t at, int64_t len){
+    Erow *row = editor_row(file_row);
+    if (at < 0 || len <= 0 || at + len > row->size) return;
+    undo_log(UNDO_DELETE, file_row, at, &row->chars[at], len);
+    editor_row_own(row);
+    memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+    row->size -= len;
+    editor_row_patch(file_row, at, 0);
+    index_add_row(file_row, at, at);
+    E.dirty++;
+}
+
+void editor_row_del_char(int64_t file_row, int64_t at){
+    editor_row_del_string(file_row, at, 1);
+}
+
+//---editor opperations---
+void editor_insert_char(int c){
+    if (E.cy == E.num_rows){
+        editor_insert_row(E.num_rows, "", 0);
+    }
+    editor_row_insert_char(E.cy, E.cx, c);
+    E.cx++;
+}
+
+void editor_del_char() {
+    if (E.cy == E.num_rows) return;
+    if (E.cx == 0 && E.cy == 0) return;
+
+    Erow *row = editor_row(E.cy);
+    if (E.cx > 0){
+        editor_row_del_char(E.cy, E.cx - 1);
+        E.cx--;
+    }else{
+        E.cx = editor_row(E.cy - 1)->size;
+        editor_row_appen_string(E.cy - 1, row->chars, row->size);
+        editor_del_row(E.cy);
+        E.cy--;
+    }
+}
+
+void editor_insert_new_line(){
+    if (E.cx == 0){
+        editor_insert_row(E.cy, "", 0);
+    }else{
+        Erow *row = editor_row(E.cy);
+        undo_log(UNDO_DELETE, E.cy, E.cx, &row->chars[E.cx], row->size - E.cx); // the tail, as it goes below
+        editor_insert_row(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+        row = editor_row(E.cy);
+        editor_row_own(row);
+        row->size = E.cx;
+        row->chars[row->size] = '\0';
+        editor_row_patch(E.cy, E.cx, 0);
+    }
+    E.cy++;
+    E.cx = 0;
+
+    Erow *row = editor_row(E.cy - 1);
+    int64_t indent = 0;
+    while (indent < row->size && (row->chars[indent] == '\t' || row->chars[indent] == ' ')){
+        editor_insert_char(row->chars[indent]);
+        indent++;
+    }
+}
+
+// Inserts text at the cursor as one edit: the cursor row is rebuilt once and
+// every further line becomes a row of its own, rendered once, with no auto
+// indent. Line endings may be \r, \n or \r\n, other control bytes but tabs
+// are dropped
+void editor_insert_text(const char *s, size_t len){
+    if (E.cy == E.num_rows){
+        editor_insert_row(E.num_rows, "", 0);
+    }
+    Erow *row = editor_row(E.cy);
+    editor_row_own(row);
+    int64_t at = E.cx < row->size ? E.cx : row->size;
+    size_t tail_len = row->size - at;
+    char *tail = malloc(tail_len + 1);
+    if (tail == NULL) die("malloc");
+    memcpy(tail, &row->chars[at], tail_len);
+
+    char *line = malloc(len + tail_len + 1);
+    if (line == NULL) die("malloc");
+    size_t n = 0, i;
+    int64_t file_row = E.cy;
+    int first = 1;
+    for (i = 0; i <= len; i++){
+        if (i < len && s[i] != '\r' && s[i] != '\n'){
+            if (!iscntrl((unsigned char)s[i]) || s[i] == '\t') line[n++] = s[i];
+            continue;
+        }
+        if (i == len){
+            E.cx = (first ? at : 0) + n;
+            memcpy(&line[n], tail, tail_len);
+            n += tail_len;
+        }
+        if (first){
+            // The cursor row keeps what was before the cursor
+            undo_log(UNDO_DELETE, file_row, at, tail, tail_len);
+            undo_log(UNDO_INSERT, file_row, at, line, n);
+            row = editor_row(file_row);
+            editor_row_reserve(row, at + n);
+            memcpy(&row->chars[at], line, n);
+            row->size = at + n;
+            row->chars[row->size] = '\0';
+            editor_row_patch(file_row, at, n);
+            index_add_row(file_row, at, row->size);
+            first = 0;
+        }else{
+            editor_insert_row(++file_row, line, n);
+        }
+        n = 0;
+        if (i + 1 < len && s[i] == '\r' && s[i + 1] == '\n') i++;
+    }
+    E.cy = file_row;
+    E.dirty++;
+    free(line);
+    free(tail);
+}
+
+// Reads a bracketed paste, whose start was just read, up to its end marker
+char *editor_read_paste(size_t *out_len){
+    static const char end[] = "\x1b[201~";
+    size_t cap = 4096, len = 0, m = sizeof(end) - 1;
+    char *buf = malloc(cap);
+    if (buf == NULL) die("malloc");
+    int c;
+    // A paste arrives in a stream, a pause as long as an escape gets means it was cut
+    while ((c = input_getc(INPUT_ESC_MS * 10, 0)) != -1){
+        if (len == cap){
+            cap *= 2;
+            buf = realloc(buf, cap);
+            if (buf == NULL) die("realloc");
+        }
+        buf[len++] = c;
+        if (len >= m && c == '~' && !memcmp(&buf[len - m], end, m)){
+            len -= m;
+            break;
+        }
+    }
+    *out_len = len;
+    return buf;
+}
+
+// Takes in a bracketed paste as one edit
+void editor_paste(){
+    size_t len;
+    char *buf = editor_read_paste(&len);
+    editor_insert_text(buf, len);
+    free(buf);
+}
+
+//---undo---
+// An op is its type byte, the cursor before its step if it begins one, its
+// row, offset and length as varints and its bytes, then the cursor after its
+// key and its own size, both fixed, so the log walks either way
+#define UNDO_TAIL 24
+
+typedef struct UndoOp{
+    int type;
+    int step;
+    int64_t cy, cx;
+    int64_t row, at, len;
+    char *s;
+    int owned; // s was read in from the file
+    int64_t after_cy, after_cx;
+    int64_t start, size;
+}UndoOp;
+
+int undo_varint_put(unsigned char *p, uint64_t v){
+    int n = 0;
+    while (v >= 0x80){
+        p[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+    return n;
+}
+
+int undo_varint_get(const unsigned char *p, int64_t *v){
+    uint64_t x = 0;
+    int n = 0, shift = 0;
+    do{
+        x |= (uint64_t)(p[n] & 0x7f) << shift;
+        shift += 7;
+    }while (p[n++] & 0x80);
+    *v = x;
+    return n;
+}
+
+void undo_read(int64_t off, void *to, int64_t n){
+    unsigned char *p = to;
+    while (n > 0 && off < undo.base){
+        if (off < undo.block_off || off >= undo.block_off + undo.block_len){
+            if (undo.block == NULL) undo.block = malloc(UNDO_BLOCK);
+            if (undo.block == NULL) die("malloc");
+            undo.block_off = off - off % UNDO_BLOCK;
+            undo.block_len = undo.base - undo.block_off < UNDO_BLOCK ? undo.base - undo.block_off : UNDO_BLOCK;
+            if (pread(undo.fd, undo.block, undo.block_len, undo.block_off) != undo.block_len) die("undo");
+        }
+        int64_t k = undo.block_off + undo.block_len - off;
+        if (k > n) k = n;
+        memcpy(p, undo.block + (off - undo.block_off), k);
+        p += k;
+        off += k;
+        n -= k;
+    }
+    if (n > 0) memcpy(p, undo.buf + (off - undo.base), n);
+}
+
+void undo_op_at(int64_t start, UndoOp *op){
+    unsigned char head[64];
+    int64_t n = undo.end - start < (int64_t)sizeof(head) ? undo.end - start : (int64_t)sizeof(head);
+    undo_read(start, head, n);
+    int i = 1;
+    op->type = head[0] & ~UNDO_STEP;
+    op->step = (head[0] & UNDO_STEP) != 0;
+    op->cy = op->cx = 0;
+    if (op->step){
+        i += undo_varint_get(&head[i], &op->cy);
+        i += undo_varint_get(&head[i], &op->cx);
+    }
+    i += undo_varint_get(&head[i], &op->row);
+    i += undo_varint_get(&head[i], &op->at);
+    i += undo_varint_get(&head[i], &op->len);
+    op->start = start;
+    op->owned = start + i < undo.base;
+    if (op->owned){
+        op->s = malloc(op->len + 1);
+        if (op->s == NULL) die("malloc");
+        undo_read(start + i, op->s, op->len);
+    }else{
+        op->s = (char *)undo.buf + (start + i - undo.base);
+    }
+    int64_t tail[3];
+    undo_read(start + i + op->len, tail, sizeof(tail));
+    op->after_cy = tail[0];
+    op->after_cx = tail[1];
+    op->size = tail[2];
+}
+
+void undo_op_before(int64_t end, UndoOp *op){
+    int64_t size;
+    undo_read(end - sizeof(size), &size, sizeof(size));
+    undo_op_at(end - size, op);
+}
+
+void undo_op_free(UndoOp *op){
+    if (op->owned) free(op->s);
+}
+
+void undo_append(const void *p, int64_t n){
+    int64_t used = undo.end - undo.base;
+    if (used + n > (int64_t)undo.cap){
+        while (used + n > (int64_t)undo.cap) undo.cap = undo.cap ? undo.cap * 2 : 4096;
+        undo.buf = realloc(undo.buf, undo.cap);
+        if (undo.buf == NULL) die("realloc");
+    }
+    memcpy(undo.buf + used, p, n);
+    undo.end += n;
+}
+
+// Writes out all but the last op, which typing may still run on in
+void undo_spill(){
+    if (undo.fd == -1){
+        char tmp[] = "/tmp/jedit-undo-XXXXXX";
+        undo.fd = mkstemp(tmp);
+        if (undo.fd == -1) return;
+        unlink(tmp);
+    }
+    int64_t n = undo.last - undo.base, done = 0;
+    while (done < n){
+        ssize_t put = pwrite(undo.fd, undo.buf + done, n - done, undo.base + done);
+        if (put <= 0) return;
+        done += put;
+    }
+    memmove(undo.buf, undo.buf + n, undo.end - undo.last);
+    undo.base = undo.last;
+    undo.block_len = 0;
+    if (undo.cap > 65536 && (int64_t)undo.cap > 4 * (undo.end - undo.base)){
+        // Only shrinks, so a failure keeps the buffer as it was
+        size_t cap = undo.end - undo.base > 32768 ? (undo.end - undo.base) * 2 : 65536;
+        unsigned char *buf = realloc(undo.buf, cap);
+        if (buf){
+            undo.buf = buf;
+            undo.cap = cap;
+        }
+    }
+}
+
+void undo_put(int flags, int64_t cy, int64_t cx, int64_t row, int64_t at, const char *s, int64_t len, const char *s2, int64_t len2){
+    unsigned char head[64];
+    int i = 0;
+    head[i++] = flags;
+    if (flags & UNDO_STEP){
+        i += undo_varint_put(&head[i], cy);
+        i += undo_varint_put(&head[i], cx);
+    }
+    i += undo_varint_put(&head[i], row);
+    i += undo_varint_put(&head[i], at);
+    i += undo_varint_put(&head[i], len + len2);
+    int64_t start = undo.end;
+    undo_append(head, i);
+    undo_append(s, len);
+    if (len2) undo_append(s2, len2);
+    int64_t tail[3] = {E.cy, E.cx, undo.end + UNDO_TAIL - start};
+    undo_append(tail, sizeof(tail));
+    undo.last = start;
+    undo.pos = undo.end;
+    undo.logged = 1;
+
+    if (!undo.budget){
+        const char *mb = getenv("JEDIT_UNDO_MB");
+        undo.budget = (int64_t)(mb && atoi(mb) > 0 ? atoi(mb) : UNDO_BUDGET_MB) << 20;
+    }
+    if (undo.end - undo.base > undo.budget && undo.last > undo.base) undo_spill();
+}
+
+// Runs typing on in the last op: more text after an insert, or a delete
+// either side of the last one, as backspace and delete take their bytes
+int undo_run_on(int type, int64_t row, int64_t at, const char *s, int64_t len){
+    if (undo.last < 0 || (type != UNDO_INSERT && type != UNDO_DELETE)) return 0;
+    UndoOp op;
+    undo_op_at(undo.last, &op);
+    int joined = op.type == type && op.row == row && op.len + len <= UNDO_RUN_MAX;
+    int before = type == UNDO_DELETE && at + len == op.at;
+    int after = at == op.at + (type == UNDO_INSERT ? op.len : 0);
+    if (!joined || (!before && !after)){
+        undo_op_free(&op);
+        return 0;
+    }
+    // The op is put again whole, its bytes copied out first as they move
+    char *old = malloc(op.len + 1);
+    if (old == NULL) die("malloc");
+    memcpy(old, op.s, op.len);
+    undo_op_free(&op);
+    undo.end = undo.last;
+    int flags = op.type | (op.step ? UNDO_STEP : 0);
+    if (before) undo_put(flags, op.cy, op.cx, row, at, s, len, old, op.len);
+    else undo_put(flags, op.cy, op.cx, row, op.at, old, op.len, s, len);
+    free(old);
+    return 1;
+}
+
+void undo_log(int type, int64_t row, int64_t at, const char *s, int64_t len){
+    if (undo.off) return;
+    if ((type == UNDO_INSERT || type == UNDO_DELETE) && len == 0) return;
+    // A new edit cuts off what was undone
+    if (undo.pos < undo.end){
+        if (undo.pos < undo.base){
+            undo.base = undo.pos;
+            undo.block_len = 0;
+            ftruncate(undo.fd, undo.base);
+        }
+        undo.end = undo.pos;
+        undo.last = -1;
+    }
+    if (!undo_run_on(type, row, at, s, len)){
+        undo_put(type | (undo.step ? UNDO_STEP : 0), undo.cy, undo.cx, row, at, s, len, NULL, 0);
+    }
+    undo.step = 0;
+}
+
+// Called before each key, typing keys of a kind run on in the same op
+void undo_begin(int kind){
+    if (kind == UNDO_KEY_OTHER || kind != undo.kind) undo.last = -1;
+    undo.kind = kind;
+    undo.step = 1;
+    undo.logged = 0;
+    undo.cy = E.cy;
+    undo.cx = E.cx;
+}
+
+// Called after each key, to note where it left the cursor
+void undo_end(){
+    if (!undo.logged) return;
+    int64_t at[2] = {E.cy, E.cx};
+    memcpy(undo.buf + (undo.end - undo.base - UNDO_TAIL), at, sizeof(at));
+}
+
+void undo_apply(UndoOp *op, int redo){
+    int insert = (op->type == UNDO_INSERT || op->type == UNDO_INSERT_ROW) == redo;
+    if (op->type == UNDO_INSERT || op->type == UNDO_DELETE){
+        if (insert) editor_row_insert_string(op->row, op->at, op->s, op->len);
+        else editor_row_del_string(op->row, op->at, op->len);
+    }else{
+        if (insert) editor_insert_row(op->row, op->s, op->len);
+        else editor_del_row(op->row);
+    }
+}
+
+void undo_cursor(int64_t cy, int64_t cx){
+    E.cy = cy < E.num_rows ? cy : E.num_rows;
+    int64_t size = E.cy < E.num_rows ? editor_row(E.cy)->size : 0;
+    E.cx = cx < size ? cx : size;
+}
+
+void editor_undo(){
+    if (undo.pos == 0){
+        editor_set_status_message("Nothing to undo");
+        return;
+    }
+    undo.off = 1;
+    UndoOp op;
+    do{
+        undo_op_before(undo.pos, &op);
+        undo_apply(&op, 0);
+        undo_op_free(&op);
+        undo.pos = op.start;
+    }while (!op.step && undo.pos > 0);
+    undo_cursor(op.cy, op.cx);
+    undo.off = 0;
+    undo.last = -1;
+}
+
+void editor_redo(){
+    if (undo.pos == undo.end){
+        editor_set_status_message("Nothing to redo");
+        return;
+    }
+    undo.off = 1;
+    UndoOp op;
+    unsigned char flags = 0;
+    do{
+        undo_op_at(undo.pos, &op);
+        undo_apply(&op, 1);
+        undo_op_free(&op);
+        undo.pos = op.start + op.size;
+        if (undo.pos < undo.end) undo_read(undo.pos, &flags, 1);
+    }while (undo.pos < undo.end && !(flags & UNDO_STEP));
+    undo_cursor(op.after_cy, op.after_cx);
+    undo.off = 0;
+    undo.last = -1;
+}
+
+//---file i/o---
+
+#define SAVE_IOV 512 // pieces per writev
+
+// Pieces of the file gathered for one writev, pointing straight into rows
+// and the map so nothing is copied
+typedef struct SaveBatch{
+    int fd;
+    int n;
+    struct iovec iov[SAVE_IOV];
+    int64_t bytes; // written so far
+}SaveBatch;
+
+int save_flush(SaveBatch *sb){
+    struct iovec *iov = sb->iov;
+    int n = sb->n;
+    sb->n = 0;
+    while (n > 0){
+        ssize_t w = writev(sb->fd, iov, n);
+        if (w == -1){
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        sb->bytes += w;
+        // Skip what went out, a short write can stop partway into a piece
+        while (n > 0 && (size_t)w >= iov->iov_len){
+            w -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0){
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return 0;
+}
+
+// Queues len bytes at p, extending the last piece when p carries straight on from it
+int save_add(SaveBatch *sb, const char *p, size_t len){
+    if (len == 0) return 0;
+    if (sb->n > 0){
+        struct iovec *last = &sb->iov[sb->n - 1];
+        if ((const char *)last->iov_base + last->iov_len == p){
+            last->iov_len += len;
+            return 0;
+        }
+    }
+    if (sb->n == SAVE_IOV && save_flush(sb) == -1) return -1;
+    sb->iov[sb->n].iov_base = (char *)p;
+    sb->iov[sb->n].iov_len = len;
+    sb->n++;
+    return 0;
+}
+
+// Streams every row, each ending in a newline, to fd. Rows still in the map
+// go out as runs of it, and the part not split into rows yet goes straight
+// from the map, leaving out the \r of \r\n as splitting it would
+int editor_write_rows(int fd, int64_t *bytes){
+    static const char nl = '\n';
+    SaveBatch sb;
+    sb.fd = fd;
+    sb.n = 0;
+    sb.bytes = 0;
+
+    RopeNode *leaf;
+    int j;
+    for (leaf = rope_first_leaf(); leaf; leaf = leaf->next){
+        for (j = 0; j < leaf->n; j++){
+            Erow *row = &leaf->u.row[j];
+            int err;
+            if ((row->flags & ROW_MAPPED) && row->chars + row->size < E.map + E.map_len &&
+                row->chars[row->size] == '\n'){
+                err = save_add(&sb, row->chars, row->size + 1);
+            }else{
+                err = save_add(&sb, row->chars, row->size) == -1 || save_add(&sb, &nl, 1) == -1 ? -1 : 0;
+            }
+            if (err == -1) return -1;
+        }
+    }
+
+    const char *p = E.map + E.map_off, *end = E.map + E.map_len;
+    while (p < end){
+        const char *cr = memchr(p, '\r', end - p);
+        if (cr == NULL) cr = end;
+        else if (cr + 1 < end && cr[1] != '\n'){
+            cr++; // a lone \r stays
+            if (save_add(&sb, p, cr - p) == -1) return -1;
+            p = cr;
+            continue;
+        }
+        if (save_add(&sb, p, cr - p) == -1) return -1;
+        p = cr < end ? cr + 1 : end;
+    }
+    if (E.map_off < E.map_len && end[-1] != '\n' && save_add(&sb, &nl, 1) == -1) return -1;
+
+    if (save_flush(&sb) == -1) return -1;
+    *bytes = sb.bytes;
+    return 0;
 }
 
 void editor_open(char *file_name){
     free(E.filename);
     E.filename = strdup(file_name);
 
-    editor_select_syntax_highlight();
+    editor_select_syntax_highlight();
+
+    int fd = open(file_name, O_RDONLY);
+    if (fd == -1) die("open");
+
+    // Regular files are mapped and split into rows lazily as they scroll into view
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0){
+        char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED){
+            close(fd);
+            E.map = map;
+            E.map_file = 1;
+            E.map_len = st.st_size;
+            E.map_off = 0;
+            E.map_lines = 0;
+            E.dirty = 0;
+            index_start();
+            loader_start();
+            return;
+        }
+    }
+
+    // Anything else is read whole into memory that then stands in for the map
+    size_t cap = 1 << 20, len = 0;
+    char *buf = malloc(cap);
+    ssize_t n;
+    while ((n = read(fd, buf + len, cap - len)) != 0){
+        if (n == -1){
+            if (errno == EINTR) continue;
+            die("read");
+        }
+        len += n;
+        if (len == cap){
+            cap *= 2;
+            buf = realloc(buf, cap);
+            if (buf == NULL) die("realloc");
+        }
+    }
+    close(fd);
+    E.dirty = 0;
+    if (len == 0){
+        free(buf);
+        return;
+    }
+    E.map = buf;
+    E.map_file = 0;
+    E.map_len = len;
+    E.map_off = 0;
+    E.map_lines = 0;
+    index_start();
+    loader_start();
+}
+
+// Writes the rows over the file where it is, keeping its inode and links
+int editor_save_in_place(const char *path, int64_t *bytes){
+    int fd = open(path, O_WRONLY);
+    if (fd == -1) return -1;
+    int ok = editor_write_rows(fd, bytes) == 0 && ftruncate(fd, *bytes) == 0 && fsync(fd) == 0;
+    int saved_errno = errno;
+    if (close(fd) == -1 || !ok){
+        if (!ok) errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+// The file is written beside the old one, synced and renamed over it, so
+// a crash mid-save leaves one or the other whole. Unedited rows still
+// point into the old file's map, which stays valid after the rename
+int editor_save_renamed(const char *path, const char *dir, struct stat *st, int64_t *bytes){
+    size_t tmp_len = strlen(path) + 8;
+    char *tmp = malloc(tmp_len);
+    if (tmp == NULL) die("malloc");
+    snprintf(tmp, tmp_len, "%s.XXXXXX", path);
+    int fd = mkstemp(tmp);
+    if (fd == -1){
+        free(tmp);
+        return -1;
+    }
+    fchmod(fd, st ? st->st_mode & 07777 : 0644);
+    int owned = !st || fchown(fd, st->st_uid, st->st_gid) == 0 || errno == EPERM;
+    if (owned && editor_write_rows(fd, bytes) == 0 && fsync(fd) == 0 && close(fd) == 0){
+        fd = -1;
+        if (rename(tmp, path) == 0){
+            // Make the rename itself durable
+            int dfd = open(dir, O_RDONLY);
+            if (dfd != -1){
+                fsync(dfd);
+                close(dfd);
+            }
+            free(tmp);
+            return 0;
+        }
+    }
+    int saved_errno = errno;
+    if (fd != -1) close(fd);
+    unlink(tmp);
+    free(tmp);
+    errno = saved_errno;
+    return -1;
+}
+
+void editor_save(){
+    if (E.filename == NULL){
+        E.filename = editor_prompt("Save as: %s", NULL);
+        if (E.filename == NULL){
+            editor_set_status_message("Save aborted");
+            return;
+        }
+        editor_select_syntax_highlight();
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    // A link is saved through to the file it names
+    char *path = realpath(E.filename, NULL);
+    if (path == NULL) path = strdup(E.filename);
+    struct stat st;
+    int exists = stat(path, &st) == 0;
+    char *slash = strrchr(path, '/');
+    char *dir = slash ? strndup(path, slash - path + 1) : strdup(".");
+
+    // A file with other links, or in a directory we can't add to, is written
+    // over in place, unless rows still point into its map
+    int64_t bytes;
+    int err;
+    if (exists && (st.st_nlink > 1 || access(dir, W_OK) != 0) && !(E.map && E.map_file)){
+        err = editor_save_in_place(path, &bytes);
+    }else{
+        err = editor_save_renamed(path, dir, exists ? &st : NULL, &bytes);
+        if (err == 0) E.map_file = 0;
+    }
+    free(path);
+    free(dir);
+    if (err == -1){
+        editor_set_status_message("Can't save! I/O error: %s", strerror(errno));
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    E.dirty = 0;
+    editor_set_status_message("file %s saved to disk, %" PRId64 " bytes in %.2fs", E.filename, bytes,
+        (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+}
+
+//---work pool---
+
+// Threads that sit idle until a batch of jobs is handed to pool_run
+typedef struct WorkPool{
+    pthread_t thread[POOL_THREADS_MAX];
+    int nthreads; // -1 until started
+    pthread_mutex_t lock;
+    pthread_cond_t work; // a batch is up
+    pthread_cond_t done; // the last job of a batch finished
+    void (*fn)(void *);
+    char *jobs;
+    size_t job_size;
+    int njobs;
+    int next; // next job to hand out
+    int running; // jobs handed out and not finished yet
+}WorkPool;
+
+WorkPool pool = {.nthreads = -1};
+
+// Runs jobs until the batch has none left, called and returning with the lock held
+void pool_drain(){
+    while (pool.next < pool.njobs){
+        char *job = pool.jobs + pool.next++ * pool.job_size;
+        pool.running++;
+        pthread_mutex_unlock(&pool.lock);
+        pool.fn(job);
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.running == 0 && pool.next == pool.njobs) pthread_cond_signal(&pool.done);
+    }
+}
+
+void *pool_worker(void *arg){
+    (void)arg;
+    pthread_mutex_lock(&pool.lock);
+    while (1){
+        while (pool.next >= pool.njobs) pthread_cond_wait(&pool.work, &pool.lock);
+        pool_drain();
+    }
+    return NULL;
+}
+
+// Threads besides the caller, one per extra cpu. Started on first use
+int pool_threads(){
+    if (pool.nthreads >= 0) return pool.nthreads;
+
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.work, NULL);
+    pthread_cond_init(&pool.done, NULL);
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int want = cpus > POOL_THREADS_MAX ? POOL_THREADS_MAX : cpus - 1;
+    pool.nthreads = 0;
+    while (pool.nthreads < want){
+        if (pthread_create(&pool.thread[pool.nthreads], NULL, pool_worker, NULL) != 0) break;
+        pool.nthreads++;
+    }
+    return pool.nthreads;
+}
+
+// Calls fn on each of the n jobs laid out job_size bytes apart, spread over
+// the pool and the calling thread, and returns once all of them are done
+void pool_run(void (*fn)(void *), void *jobs, size_t job_size, int n){
+    if (pool_threads() == 0 || n < 2){
+        int i;
+        for (i = 0; i < n; i++) fn((char *)jobs + i * job_size);
+        return;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.fn = fn;
+    pool.jobs = jobs;
+    pool.job_size = job_size;
+    pool.njobs = n;
+    pool.next = 0;
+    pthread_cond_broadcast(&pool.work);
+    pool_drain();
+    while (pool.running > 0) pthread_cond_wait(&pool.done, &pool.lock);
+    pool.njobs = 0;
+    pool.next = 0;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+//---regex---
+#define RE_MAX_STATES 10000
+#define RE_MAX_REPEAT 1000
+#define DFA_MAX_STATES 1024 // cached states per dfa before the cache is flushed
+#define DFA_BUCKETS 1024
+
+enum ReNodeType{
+    RN_EMPTY = 0,
+    RN_CLASS,
+    RN_CAT,
+    RN_ALT,
+    RN_REPEAT,
+    RN_BOL,
+    RN_EOL
+};
+
+typedef struct ReNode{
+    int type;
+    struct ReNode *a, *b;
+    int min, max; // max is -1 for no limit
+    unsigned char cls[32];
+}ReNode;
+
+typedef struct ReParser{
+    const char *p;
+    ReNode *node;
+    int nnodes;
+    int error;
+}ReParser;
+
+enum ReStateType{
+    RE_CLASS = 0,
+    RE_SPLIT,
+    RE_EDGE_START, // only passes at the line edge a scan starts from
+    RE_EDGE_END, // only passes at the line edge a scan ends on
+    RE_MATCH
+};
+
+typedef struct ReState{
+    int type;
+    int out, out1;
+    unsigned char cls[32];
+}ReState;
+
+// A Thompson nfa compiled twice, forwards and for scanning a line backwards
+typedef struct Regex{
+    ReState *state;
+    int nstates;
+    int cap;
+    int forward;
+    int reverse;
+}Regex;
+
+void re_class_set(unsigned char *cls, int c){
+    cls[c >> 3] |= 1 << (c & 7);
+}
+
+// \d \w \s and their negations, 0 for any other escape
+int re_class_escape(unsigned char *cls, int e){
+    int c, neg = isupper(e);
+    switch (tolower(e)){
+        case 'd': for (c = 0; c < 256; c++) if (isdigit(c)) re_class_set(cls, c); break;
+        case 'w': for (c = 0; c < 256; c++) if (isalnum(c) || c == '_') re_class_set(cls, c); break;
+        case 's': for (c = 0; c < 256; c++) if (isspace(c)) re_class_set(cls, c); break;
+        default: return 0;
+    }
+    if (neg){
+        for (c = 0; c < 32; c++) cls[c] = ~cls[c];
+        cls['\n' >> 3] &= ~(1 << ('\n' & 7));
+    }
+    return 1;
+}
+
+int re_escape_char(int e){
+    return e == 't' ? '\t' : e == 'r' ? '\r' : e == 'f' ? '\f' : e == 'v' ? '\v' : e;
+}
+
+ReNode *re_node(ReParser *ps, int type, ReNode *a, ReNode *b){
+    ReNode *n = &ps->node[ps->nnodes++];
+    memset(n, 0, sizeof(ReNode));
+    n->type = type;
+    n->a = a;
+    n->b = b;
+    return n;
+}
+
+ReNode *re_parse_alt(ReParser *ps);
+
+// [...] with ranges, escapes and a leading ^ to negate
+ReNode *re_parse_class(ReParser *ps){
+    ReNode *n = re_node(ps, RN_CLASS, NULL, NULL);
+    int neg = 0, c;
+    if (*ps->p == '^'){
+        neg = 1;
+        ps->p++;
+    }
+    int first = 1;
+    while (*ps->p && (*ps->p != ']' || first)){
+        first = 0;
+        int lo = (unsigned char)*ps->p++;
+        if (lo == '\\' && *ps->p){
+            int e = (unsigned char)*ps->p++;
+            if (re_class_escape(n->cls, e)) continue;
+            lo = re_escape_char(e);
+        }
+        int hi = lo;
+        if (ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']'){
+            hi = (unsigned char)ps->p[1];
+            ps->p += 2;
+            if (hi == '\\' && *ps->p) hi = re_escape_char((unsigned char)*ps->p++);
+        }
+        for (c = lo; c <= hi; c++) re_class_set(n->cls, c);
+    }
+    if (*ps->p != ']'){
+        ps->error = 1;
+        return n;
+    }
+    ps->p++;
+    if (neg){
+        for (c = 0; c < 32; c++) n->cls[c] = ~n->cls[c];
+    }
+    n->cls['\n' >> 3] &= ~(1 << ('\n' & 7)); // matches never span rows
+    return n;
+}
+
+ReNode *re_parse_atom(ReParser *ps){
+    int c = (unsigned char)*ps->p++;
+    ReNode *n;
+    switch (c){
+        case '(':
+            n = re_parse_alt(ps);
+            if (*ps->p != ')') ps->error = 1;
+            else ps->p++;
+            return n;
+        case '[':
+            return re_parse_class(ps);
+        case '^':
+            return re_node(ps, RN_BOL, NULL, NULL);
+        case '$':
+            return re_node(ps, RN_EOL, NULL, NULL);
+        case '.':
+            n = re_node(ps, RN_CLASS, NULL, NULL);
+            memset(n->cls, 0xff, sizeof(n->cls));
+            n->cls['\n' >> 3] &= ~(1 << ('\n' & 7));
+            return n;
+        case '*': case '+': case '?':
+            ps->error = 1; // nothing to repeat
+            return re_node(ps, RN_EMPTY, NULL, NULL);
+    }
+    n = re_node(ps, RN_CLASS, NULL, NULL);
+    if (c == '\\'){
+        if (*ps->p == '\0'){
+            ps->error = 1;
+            return n;
+        }
+        c = (unsigned char)*ps->p++;
+        if (re_class_escape(n->cls, c)) return n;
+        c = re_escape_char(c);
+    }
+    re_class_set(n->cls, c);
+    return n;
+}
+
+// {m}, {m,} or {m,n} after an atom, anything else leaves the '{' a literal
+int re_parse_bounds(ReParser *ps, int *min, int *max){
+    const char *p = ps->p + 1;
+    if (!isdigit(*p)) return 0;
+    // Read wide and checked before narrowing, strtol saturates rather than wraps
+    long lo = strtol(p, (char **)&p, 10), hi = lo;
+    if (*p == ','){
+        p++;
+        hi = isdigit(*p) ? strtol(p, (char **)&p, 10) : -1;
+    }
+    if (*p != '}') return 0;
+    if (lo > RE_MAX_REPEAT || hi > RE_MAX_REPEAT || (hi != -1 && hi < lo)) ps->error = 1;
+    *min = lo > RE_MAX_REPEAT ? RE_MAX_REPEAT : lo;
+    *max = hi > RE_MAX_REPEAT ? RE_MAX_REPEAT : hi;
+    ps->p = p + 1;
+    return 1;
+}
+
+ReNode *re_parse_repeat(ReParser *ps){
+    ReNode *n = re_parse_atom(ps);
+    while (!ps->error){
+        int min, max;
+        char c = *ps->p;
+        if (c == '*'){
+            min = 0;
+            max = -1;
+        }else if (c == '+'){
+            min = 1;
+            max = -1;
+        }else if (c == '?'){
+            min = 0;
+            max = 1;
+        }else if (c == '{' && re_parse_bounds(ps, &min, &max)){
+            ps->p--;
+        }else{
+            break;
+        }
+        ps->p++;
+        n = re_node(ps, RN_REPEAT, n, NULL);
+        n->min = min;
+        n->max = max;
+    }
+    return n;
+}
+
+ReNode *re_parse_cat(ReParser *ps){
+    ReNode *n = NULL;
+    while (*ps->p && *ps->p != '|' && *ps->p != ')' && !ps->error){
+        ReNode *atom = re_parse_repeat(ps);
+        n = n ? re_node(ps, RN_CAT, n, atom) : atom;
+    }
+    return n ? n : re_node(ps, RN_EMPTY, NULL, NULL);
+}
+
+ReNode *re_parse_alt(ReParser *ps){
+    ReNode *n = re_parse_cat(ps);
+    while (*ps->p == '|' && !ps->error){
+        ps->p++;
+        n = re_node(ps, RN_ALT, n, re_parse_cat(ps));
+    }
+    return n;
+}
+
+int re_add(Regex *re, int type, int out, int out1){
+    if (re->nstates == RE_MAX_STATES) return -1;
+    if (re->nstates == re->cap){
+        re->cap = re->cap ? re->cap * 2 : 64;
+        re->state = realloc(re->state, sizeof(ReState) * re->cap);
+        if (re->state == NULL) die("realloc");
+    }
+    ReState *s = &re->state[re->nstates];
+    memset(s, 0, sizeof(ReState));
+    s->type = type;
+    s->out = out;
+    s->out1 = out1;
+    return re->nstates++;
+}
+
+// Emits the program for n back to front, so every piece already knows the
+// state it continues to. Returns its entry, or -1 once the program is too big
+int re_emit(Regex *re, ReNode *n, int next, int reverse){
+    int s, body, k;
+    if (next < 0) return -1;
+    switch (n->type){
+        case RN_EMPTY:
+            return next;
+        case RN_CLASS:
+            s = re_add(re, RE_CLASS, next, -1);
+            if (s >= 0) memcpy(re->state[s].cls, n->cls, sizeof(n->cls));
+            return s;
+        case RN_CAT:
+            return reverse ? re_emit(re, n->b, re_emit(re, n->a, next, reverse), reverse)
+                           : re_emit(re, n->a, re_emit(re, n->b, next, reverse), reverse);
+        case RN_ALT:
+            body = re_emit(re, n->a, next, reverse);
+            s = re_emit(re, n->b, next, reverse);
+            return (body < 0 || s < 0) ? -1 : re_add(re, RE_SPLIT, body, s);
+        case RN_BOL:
+            return re_add(re, reverse ? RE_EDGE_END : RE_EDGE_START, next, -1);
+        case RN_EOL:
+            return re_add(re, reverse ? RE_EDGE_START : RE_EDGE_END, next, -1);
+        case RN_REPEAT:
+            if (n->max == -1){
+                // A split loops back over the body, entered at the split
+                // when no copy is needed
+                s = re_add(re, RE_SPLIT, -1, next);
+                body = re_emit(re, n->a, s, reverse);
+                if (s < 0 || body < 0) return -1;
+                re->state[s].out = body;
+                next = n->min ? body : s;
+                k = n->min - 1;
+            }else{
+                // Optional copies nest, each one may skip to the end
+                int end = next;
+                for (k = n->min; k < n->max && next >= 0; k++){
+                    body = re_emit(re, n->a, next, reverse);
+                    next = body < 0 ? -1 : re_add(re, RE_SPLIT, body, end);
+                }
+                k = n->min;
+            }
+            for (; k > 0 && next >= 0; k--) next = re_emit(re, n->a, next, reverse);
+            return next;
+    }
+    return -1;
+}
 
-    FILE *fp = fopen(file_name, "r");
-    if (!fp) die("fopen"); // fp is NULL
+// Compiles pattern, NULL when it is malformed or too big
+Regex *regex_compile(const char *pattern){
+    ReParser ps;
+    ps.p = pattern;
+    ps.node = malloc(sizeof(ReNode) * (3 * strlen(pattern) + 2));
+    if (ps.node == NULL) die("malloc");
+    ps.nnodes = 0;
+    ps.error = 0;
+    ReNode *root = re_parse_alt(&ps);
+    if (*ps.p) ps.error = 1; // a stray ')'
+
+    Regex *re = calloc(1, sizeof(Regex));
+    if (re == NULL) die("calloc");
+    if (!ps.error){
+        re->forward = re_emit(re, root, re_add(re, RE_MATCH, -1, -1), 0);
+        re->reverse = re_emit(re, root, re_add(re, RE_MATCH, -1, -1), 1);
+    }
+    free(ps.node);
+    if (ps.error || re->forward < 0 || re->reverse < 0){
+        free(re->state);
+        free(re);
+        return NULL;
+    }
+    return re;
+}
 
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t line_len;
-    while ((line_len = getline(&line, &linecap, fp)) != -1){
-        while (line_len > 0 && (line[line_len - 1] == '\n' 
-                || line[line_len - 1] == '\r'))
-            line_len--;
+void regex_free(Regex *re){
+    if (re == NULL) return;
+    free(re->state);
+    free(re);
+}
 
-        editor_insert_row(E.num_rows, line, line_len);
+// A set of nfa states, built the first time a scan reaches it
+typedef struct DfaState{
+    struct DfaState *next[256];
+    struct DfaState *chain;
+    unsigned int hash;
+    int start; // nothing consumed yet, which never counts as a match
+    int match; // a thread has matched the byte just consumed
+    int end_match; // a thread would match if the line ended here
+    int n;
+    int set[];
+}DfaState;
+
+// A lazily built dfa over one of the regex programs. Each search job has its
+// own so nothing is shared between threads
+typedef struct Dfa{
+    Regex *re;
+    int entry;
+    int unanchored; // every step starts a fresh thread too
+    DfaState *bucket[DFA_BUCKETS];
+    DfaState *start_state[2]; // away from and at a line edge
+    int nstates;
+    int *restart; // entry's closure away from a line edge
+    int nrestart;
+    unsigned int *mark;
+    unsigned int gen;
+    int *stack;
+    int *buf;
+    int *saved;
+}Dfa;
+
+// Adds the states reachable from s without consuming a byte to out
+void dfa_closure(Dfa *d, int s, int at_edge, int *out, int *n){
+    int sp = 0;
+    d->stack[sp++] = s;
+    while (sp){
+        s = d->stack[--sp];
+        if (d->mark[s] == d->gen) continue;
+        d->mark[s] = d->gen;
+        ReState *st = &d->re->state[s];
+        if (st->type == RE_SPLIT){
+            d->stack[sp++] = st->out1;
+            d->stack[sp++] = st->out;
+        }else if (st->type == RE_EDGE_START){
+            if (at_edge) d->stack[sp++] = st->out;
+        }else{
+            out[(*n)++] = s;
+        }
     }
-    free(line);
-    fclose(fp);
-    E.dirty = 0;
 }
 
-void editor_save(){
-    if (E.filename == NULL){
-        E.filename = editor_prompt("Save as: %s", NULL);
-        if (E.filename == NULL){
-            editor_set_status_message("Save aborted");
-            return;
+void dfa_init(Dfa *d, Regex *re, int entry, int unanchored){
+    memset(d, 0, sizeof(Dfa));
+    d->re = re;
+    d->entry = entry;
+    d->unanchored = unanchored;
+    d->mark = calloc(re->nstates, sizeof(unsigned int));
+    d->stack = malloc(sizeof(int) * (3 * re->nstates + 1));
+    d->buf = malloc(sizeof(int) * re->nstates);
+    d->saved = malloc(sizeof(int) * re->nstates);
+    d->restart = malloc(sizeof(int) * re->nstates);
+    if (d->mark == NULL || d->stack == NULL || d->buf == NULL || d->saved == NULL || d->restart == NULL) die("malloc");
+    d->gen++;
+    dfa_closure(d, entry, 0, d->restart, &d->nrestart);
+}
+
+void dfa_flush(Dfa *d){
+    int i;
+    for (i = 0; i < DFA_BUCKETS; i++){
+        while (d->bucket[i]){
+            DfaState *next = d->bucket[i]->chain;
+            free(d->bucket[i]);
+            d->bucket[i] = next;
         }
-        editor_select_syntax_highlight();
     }
+    d->start_state[0] = d->start_state[1] = NULL;
+    d->nstates = 0;
+}
+
+void dfa_free(Dfa *d){
+    if (d->re == NULL) return;
+    dfa_flush(d);
+    free(d->mark);
+    free(d->stack);
+    free(d->buf);
+    free(d->saved);
+    free(d->restart);
+}
+
+int dfa_int_cmp(const void *a, const void *b){
+    return *(const int *)a - *(const int *)b;
+}
+
+// Would a thread in s match once the line ends
+int dfa_end_match(Dfa *d, DfaState *s){
+    int i, sp = 0;
+    d->gen++;
+    for (i = 0; i < s->n; i++){
+        if (d->re->state[s->set[i]].type == RE_EDGE_END) d->stack[sp++] = d->re->state[s->set[i]].out;
+    }
+    while (sp){
+        int k = d->stack[--sp];
+        if (d->mark[k] == d->gen) continue;
+        d->mark[k] = d->gen;
+        ReState *st = &d->re->state[k];
+        if (st->type == RE_MATCH) return 1;
+        if (st->type == RE_SPLIT){
+            d->stack[sp++] = st->out1;
+            d->stack[sp++] = st->out;
+        }else if (st->type == RE_EDGE_END){
+            d->stack[sp++] = st->out;
+        }
+    }
+    return 0;
+}
+
+DfaState *dfa_intern(Dfa *d, int *set, int n, int start){
+    qsort(set, n, sizeof(int), dfa_int_cmp);
+    unsigned int h = 2166136261u ^ start;
+    int i;
+    for (i = 0; i < n; i++) h = (h ^ set[i]) * 16777619u;
+
+    DfaState *s;
+    for (s = d->bucket[h & (DFA_BUCKETS - 1)]; s; s = s->chain){
+        if (s->hash == h && s->n == n && s->start == start && !memcmp(s->set, set, sizeof(int) * n)) return s;
+    }
+
+    s = calloc(1, sizeof(DfaState) + sizeof(int) * n);
+    if (s == NULL) die("calloc");
+    s->hash = h;
+    s->start = start;
+    s->n = n;
+    memcpy(s->set, set, sizeof(int) * n);
+    if (!start){
+        for (i = 0; i < n; i++){
+            if (d->re->state[set[i]].type == RE_MATCH) s->match = 1;
+        }
+        s->end_match = dfa_end_match(d, s);
+    }
+    s->chain = d->bucket[h & (DFA_BUCKETS - 1)];
+    d->bucket[h & (DFA_BUCKETS - 1)] = s;
+    d->nstates++;
+    return s;
+}
+
+DfaState *dfa_start(Dfa *d, int at_edge){
+    if (d->start_state[at_edge] == NULL){
+        int n = 0;
+        d->gen++;
+        dfa_closure(d, d->entry, at_edge, d->buf, &n);
+        d->start_state[at_edge] = dfa_intern(d, d->buf, n, 1);
+    }
+    return d->start_state[at_edge];
+}
+
+// Works out where s goes on byte c and caches it. A full cache is flushed
+// first, so the pointer passed in must not be used again
+DfaState *dfa_next(Dfa *d, DfaState *s, int c){
+    if (d->nstates >= DFA_MAX_STATES){
+        int n = s->n, start = s->start;
+        memcpy(d->saved, s->set, sizeof(int) * n);
+        dfa_flush(d);
+        s = dfa_intern(d, d->saved, n, start);
+    }
+
+    int i, n = 0;
+    d->gen++;
+    for (i = 0; i < s->n + (d->unanchored ? d->nrestart : 0); i++){
+        int k = i < s->n ? s->set[i] : d->restart[i - s->n];
+        ReState *st = &d->re->state[k];
+        if (st->type == RE_CLASS && (st->cls[c >> 3] & (1 << (c & 7)))) dfa_closure(d, st->out, 0, d->buf, &n);
+    }
+    DfaState *next = dfa_intern(d, d->buf, n, 0);
+    s->next[c] = next;
+    return next;
+}
 
+DfaState *dfa_step(Dfa *d, DfaState *s, unsigned char c){
+    return s->next[c] ? s->next[c] : dfa_next(d, s, c);
+}
+
+//---search---
+#define SEARCH_MAX_MATCHES (1 << 22) // positions kept, the total keeps counting past it
+#define SEARCH_SPAN_ROWS 4096
+#define SEARCH_JOB_ROWS 16384 // smallest run of rows or stretch of map worth a job
+#define SEARCH_JOB_BYTES (4 << 20)
+
+typedef struct SearchMatch{
+    const char *at; // into chars or the map, neither moves while find is open
+    int64_t len;
+    int64_t row;
+}SearchMatch;
+
+typedef struct SearchResults{
+    SearchMatch *match;
     int len;
-    char *buf = editor_rows_to_string(&len);
-
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-    if (fd != -1){
-        if (ftruncate(fd, len) != -1){
-            if (write(fd, buf, len) == len){
-                close(fd);
-                free(buf);
-                E.dirty = 0;
-                editor_set_status_message("file %s saved to disk", E.filename);
-                return;
-            }
+    int cap;
+    int limit; // positions kept, 0 for SEARCH_MAX_MATCHES
+    long total;
+}SearchResults;
+
+// memchr finds the first byte and the last byte rules out most candidates
+// before the memcmp
+const char *search_scalar(const char *hay, size_t n, const char *needle, size_t m){
+    if (m == 0 || m > n) return NULL;
+    const char *p = hay, *end = hay + n - m + 1;
+    while (p < end){
+        p = memchr(p, needle[0], end - p);
+        if (p == NULL) return NULL;
+        if (p[m - 1] == needle[m - 1] && !memcmp(p, needle, m)) return p;
+        p++;
+    }
+    return NULL;
+}
+
+#ifdef SEARCH_X86
+// Tests 16 starting positions at once against the first and last byte of the
+// needle, only positions where both agree are compared in full
+const char *search_sse2(const char *hay, size_t n, const char *needle, size_t m){
+    if (m == 0 || m > n) return NULL;
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[m - 1]);
+    size_t i;
+    for (i = 0; i + m + 15 <= n; i += 16){
+        __m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(hay + i + m - 1));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask){
+            const char *p = hay + i + __builtin_ctz(mask);
+            if (m <= 2 || !memcmp(p + 1, needle + 1, m - 2)) return p;
+            mask &= mask - 1;
         }
-        close(fd);
     }
-    free(buf);
-    editor_set_status_message("Can't save! I/O error: %s", strerror(errno));
+    return search_scalar(hay + i, n - i, needle, m);
 }
 
-//---find---
-void editor_find_callback(char *query, int key){
-    static int last_match = -1;
-    static int direction = 1;
+__attribute__((target("avx2")))
+const char *search_avx2(const char *hay, size_t n, const char *needle, size_t m){
+    if (m == 0 || m > n) return NULL;
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[m - 1]);
+    size_t i;
+    for (i = 0; i + m + 63 <= n; i += 64){
+        // Two blocks per pass and one branch for both, candidates are rare
+        __m256i lo = _mm256_and_si256(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(hay + i)), first),
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(hay + i + m - 1)), last));
+        __m256i hi = _mm256_and_si256(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(hay + i + 32)), first),
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(hay + i + m + 31)), last));
+        if (_mm256_testz_si256(_mm256_or_si256(lo, hi), _mm256_or_si256(lo, hi))) continue;
+        unsigned long long mask = (unsigned int)_mm256_movemask_epi8(lo) |
+            (unsigned long long)(unsigned int)_mm256_movemask_epi8(hi) << 32;
+        while (mask){
+            const char *p = hay + i + __builtin_ctzll(mask);
+            if (m <= 2 || !memcmp(p + 1, needle + 1, m - 2)) return p;
+            mask &= mask - 1;
+        }
+    }
+    return search_scalar(hay + i, n - i, needle, m);
+}
+#endif
+
+const char *(*search_impl)(const char *, size_t, const char *, size_t) = NULL;
+unsigned char search_common[256]; // bytes frequent enough in text that memchr stops on them all the time
+
+// Picks the widest filter the cpu has, before any search job runs
+void search_init(){
+    if (search_impl) return;
+    const char *common = " \t\netaoinshrdlcumwfgypbvk_.,;:=()[]{}\"'*-/0123456789";
+    for (; *common; common++) search_common[(unsigned char)*common] = 1;
+    search_impl = search_scalar;
+#ifdef SEARCH_X86
+    search_impl = __builtin_cpu_supports("avx2") ? search_avx2 : search_sse2;
+#endif
+}
+
+// A rare first byte is left to memchr, which only looks for that one byte
+// and outruns the two byte filter when it seldom stops
+const char *search_memmem(const char *hay, size_t n, const char *needle, size_t m){
+    if (m == 1 || !search_common[(unsigned char)needle[0]]) return search_scalar(hay, n, needle, m);
+    return search_impl(hay, n, needle, m);
+}
+
+int64_t search_count_newlines(const char *s, size_t n){
+    int64_t count = 0;
+    size_t i = 0;
+#ifdef SEARCH_X86
+    const __m128i nl = _mm_set1_epi8('\n');
+    for (; i + 16 <= n; i += 16){
+        __m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(a, nl)));
+    }
+#endif
+    for (; i < n; i++) count += s[i] == '\n';
+    return count;
+}
 
-    static int saved_hl_line;
-    static char *saved_hl = NULL;
+void search_add(SearchResults *res, const char *at, int64_t len, int64_t row){
+    res->total++;
+    if (res->len == (res->limit ? res->limit : SEARCH_MAX_MATCHES)) return;
+    if (res->len == res->cap){
+        res->cap = res->cap ? res->cap * 2 : 64;
+        res->match = realloc(res->match, sizeof(SearchMatch) * res->cap);
+        if (res->match == NULL) die("realloc");
+    }
+    res->match[res->len].at = at;
+    res->match[res->len].len = len;
+    res->match[res->len].row = row;
+    res->len++;
+}
 
-    if (saved_hl){
-        memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-        free(saved_hl);
-        saved_hl = NULL;
+typedef struct SearchJob{
+    const char *q;
+    size_t m;
+    Regex *re; // set for a regex search instead of q
+    int64_t row; // first row, a stretch of map numbers its rows from 0
+    int64_t nrows;
+    const char *start; // where to begin in the first row or the map
+    const char *line; // start of the line holding start in the map
+    const char *end; // end of a stretch of map, NULL for a run of rows
+    int64_t lines; // newlines in the stretch of map
+    const unsigned char *cand; // index blocks that may hold q, NULL to search them all
+    SearchResults res;
+    // A regex search finds lines with a match, scans each back to mark where
+    // matches start and then takes the longest from the leftmost start
+    Dfa find, back, longest;
+    unsigned char *starts;
+    int64_t starts_cap;
+}SearchJob;
+
+// Adds the leftmost longest matches in the row s that start from `from` on
+void search_regex_row(SearchJob *job, const char *s, int64_t len, int64_t from, int64_t row){
+    if (from >= len) return;
+    if (len - from > job->starts_cap){
+        job->starts_cap = len - from;
+        job->starts = realloc(job->starts, job->starts_cap);
+        if (job->starts == NULL) die("realloc");
     }
+    unsigned char *starts = job->starts - from;
 
+    DfaState *st = dfa_start(&job->back, 1);
+    int64_t i;
+    for (i = len - 1; i >= from; i--){
+        st = dfa_step(&job->back, st, s[i]);
+        starts[i] = st->match || (i == 0 && st->end_match);
+    }
 
-    if (key == '\r' || key == '\x1b'){
-        last_match = -1;
-        direction = 1;
+    i = from;
+    while (1){
+        while (i < len && !starts[i]) i++;
+        if (i == len) break;
+        st = dfa_start(&job->longest, i == 0);
+        int64_t end = i, k;
+        for (k = i; k < len; k++){
+            st = dfa_step(&job->longest, st, s[k]);
+            if (st->n == 0) break;
+            if (st->match) end = k + 1;
+        }
+        if (k == len && st->end_match) end = len;
+        if (end == i){
+            i++;
+            continue;
+        }
+        search_add(&job->res, s + i, end - i, row);
+        i = end;
+    }
+}
+
+// The start of the first line from p on that may hold a match, or NULL. A
+// '\r' is taken for a line end as well so rows ending "\r\n" aren't missed,
+// the row itself decides in the end
+const char *search_regex_line(Dfa *d, const char *p, const char *end){
+    const char *line = p;
+    DfaState *st = dfa_start(d, 1);
+    for (; p < end; p++){
+        unsigned char c = *p;
+        if (c == '\n' || c == '\r'){
+            if (st->end_match) return line;
+            if (c == '\n'){
+                st = dfa_start(d, 1);
+                line = p + 1;
+                continue;
+            }
+        }
+        st = dfa_step(d, st, c);
+        if (st->match) return line;
+    }
+    return st->end_match ? line : NULL;
+}
+
+// Rows in span sit back to back in one block of memory, separated only by
+// their line endings, so the whole span is searched with one call starting at p
+void search_span(SearchJob *job, Erow **span, int n, int64_t first, const char *p){
+    const char *end = span[n - 1]->chars + span[n - 1]->size;
+    int j = 0;
+    if (job->re){
+        if (p != span[0]->chars){
+            // Resuming inside the first row, which still anchors at its start
+            search_regex_row(job, span[0]->chars, span[0]->size, p - span[0]->chars, first);
+            if (++j == n) return;
+            p = span[j]->chars;
+        }
+        while ((p = search_regex_line(&job->find, p, end)) != NULL){
+            while (p > span[j]->chars + span[j]->size) j++;
+            search_regex_row(job, span[j]->chars, span[j]->size, 0, first + j);
+            if (++j == n) return;
+            p = span[j]->chars;
+        }
         return;
-    }else if (key == ARROW_RIGHT || key == ARROW_DOWN){
-        direction = 1;
-    }else if (key == ARROW_LEFT || key == ARROW_UP){
-        direction = -1;
+    }
+    while ((p = search_memmem(p, end - p, job->q, job->m)) != NULL){
+        // A query never holds a line ending so every match fits inside one row
+        while (p >= span[j]->chars + span[j]->size) j++;
+        search_add(&job->res, p, job->m, first + j);
+        p++;
+    }
+}
+
+// Searches the part of the map not split into rows yet from p to end,
+// numbering rows from 0 by counting newlines between matches so nothing gets
+// indexed. Returns the newlines in the whole stretch
+int64_t search_map(SearchJob *job, const char *line, const char *p, const char *end, int64_t row){
+    const char *counted = p;
+    if (job->re){
+        while (p < end){
+            if (p == line && (line = search_regex_line(&job->find, p, end)) == NULL) break;
+            row += search_count_newlines(counted, line - counted);
+            counted = line;
+            const char *nl = memchr(line, '\n', end - line);
+            int64_t len = (nl ? nl : end) - line;
+            if (len > 0 && line[len - 1] == '\r') len--;
+            search_regex_row(job, line, len, p - line, row);
+            if (nl == NULL) break;
+            p = line = nl + 1;
+        }
+    }else{
+        while ((p = search_memmem(p, end - p, job->q, job->m)) != NULL){
+            row += search_count_newlines(counted, p - counted);
+            counted = p;
+            search_add(&job->res, p, job->m, row);
+            p++;
+        }
+    }
+    return row + search_count_newlines(counted, end - counted);
+}
+
+// search_map over just the candidate blocks, the lines of the others are
+// only counted
+int64_t search_map_blocks(SearchJob *job, const char *line, const char *p, const char *end){
+    int64_t row = 0;
+    while (p < end){
+        size_t at = p - E.map;
+        int k = at / INDEX_BLOCK;
+        while (tindex.start[k] > at) k--;
+        const char *from = E.map + tindex.start[k], *to = E.map + tindex.start[k + 1];
+        const char *stop = to < end ? to : end;
+        if (job->cand[k]){
+            row = search_map(job, line, p, stop, row);
+        }else{
+            row += (p == from && stop == to) ? tindex.lines[k] : search_count_newlines(p, stop - p);
+        }
+        p = line = stop;
+    }
+    return row;
+}
+
+// Searches nrows rows from row on, starting at p in the first one. Mapped rows
+// that still follow each other in the file are coalesced into spans, edited
+// rows are a span of their own
+void search_rows(SearchJob *job, int64_t row, int64_t nrows, const char *start){
+    Erow *span[SEARCH_SPAN_ROWS];
+    int nspan = 0;
+    int64_t first = row;
+    const char *p = NULL;
+    int off;
+    RopeNode *leaf = rope_find(row, &off);
+    for (; nrows > 0; nrows--, row++){
+        if (off == 0 && job->cand && !index_leaf_candidate(leaf, job->cand)){
+            // None of this leaf's rows can match
+            if (nspan) search_span(job, span, nspan, first, p);
+            nspan = 0;
+            int64_t skip = leaf->n < nrows ? leaf->n : nrows;
+            nrows -= skip - 1;
+            row += skip - 1;
+            leaf = leaf->next;
+            continue;
+        }
+        Erow *erow = &leaf->u.row[off];
+        if (nspan){
+            Erow *prev = span[nspan - 1];
+            int joined = nspan < SEARCH_SPAN_ROWS && (erow->flags & prev->flags & ROW_MAPPED);
+            if (joined){
+                long gap = erow->chars - (prev->chars + prev->size);
+                joined = gap == 1 || gap == 2;
+            }
+            if (!joined){
+                search_span(job, span, nspan, first, p);
+                nspan = 0;
+            }
+        }
+        if (nspan == 0){
+            p = (start && row == first) ? start : erow->chars;
+            first = row;
+        }
+        span[nspan++] = erow;
+        if (++off == leaf->n){
+            leaf = leaf->next;
+            off = 0;
+        }
+    }
+    if (nspan) search_span(job, span, nspan, first, p);
+}
+
+void search_job(void *arg){
+    SearchJob *job = arg;
+    if (job->re){
+        dfa_init(&job->find, job->re, job->re->forward, 1);
+        dfa_init(&job->back, job->re, job->re->reverse, 1);
+        dfa_init(&job->longest, job->re, job->re->forward, 0);
+    }
+    if (job->end && job->cand){
+        job->lines = search_map_blocks(job, job->line, job->start, job->end);
+    }else if (job->end){
+        job->lines = search_map(job, job->line, job->start, job->end, 0);
     }else{
-        last_match = -1;
-        direction = 1;
+        search_rows(job, job->row, job->nrows, job->start);
     }
-    if (last_match == -1) direction = 1;
-    int current = last_match;
+    if (job->re){
+        dfa_free(&job->find);
+        dfa_free(&job->back);
+        dfa_free(&job->longest);
+        free(job->starts);
+    }
+}
+
+// Finds every match of q, or of re when it is set, in the buffer. Plain
+// matches may overlap so the matches of a longer query are always a subset,
+// regex matches are the leftmost longest ones. The rows and the unsplit map
+// are cut into jobs for the work pool, whose results are joined in order.
+// Once the trigram index is ready a plain search only reads the blocks it
+// names as candidates. With from_at set the search starts there, in from_row,
+// and adds to res instead of starting over
+void search_buffer(SearchResults *res, const char *q, size_t m, Regex *re, int64_t from_row, const char *from_at){
+    if (from_at == NULL){
+        from_row = 0;
+        res->len = 0;
+        res->total = 0;
+    }
+    if (m == 0 && re == NULL) return;
+
+    search_init();
+    unsigned char *cand = re ? NULL : index_candidates(q, m);
+    int parts = 4 * (pool_threads() + 1);
+    SearchJob *job = calloc(2 * parts + 2, sizeof(SearchJob));
+    if (job == NULL) die("calloc");
+    int njobs = 0;
+
+    int64_t nrows = E.num_rows - from_row;
+    if (nrows > 0){
+        int64_t per = (nrows + parts - 1) / parts;
+        if (per < SEARCH_JOB_ROWS) per = SEARCH_JOB_ROWS;
+        int64_t row;
+        for (row = from_row; row < E.num_rows; row += per){
+            job[njobs].row = row;
+            job[njobs].nrows = (E.num_rows - row < per) ? E.num_rows - row : per;
+            job[njobs].start = (row == from_row) ? from_at : NULL;
+            njobs++;
+        }
+    }
+    int map_job = njobs;
+    if (E.map_off < E.map_len){
+        const char *p = E.map + E.map_off, *line = p;
+        if (from_at && from_row >= E.num_rows){
+            p = from_at;
+            line = memrchr(E.map + E.map_off, '\n', p - (E.map + E.map_off));
+            line = line ? line + 1 : E.map + E.map_off;
+        }
+        const char *end = E.map + E.map_len;
+        size_t per = (end - p + parts - 1) / parts;
+        if (per < SEARCH_JOB_BYTES) per = SEARCH_JOB_BYTES;
+        while (p < end){
+            // Stretches end on a newline so no match is cut in two
+            const char *stop = end;
+            if ((size_t)(end - p) > per){
+                stop = memchr(p + per, '\n', end - p - per);
+                stop = stop ? stop + 1 : end;
+            }
+            job[njobs].start = p;
+            job[njobs].line = line;
+            job[njobs].end = stop;
+            njobs++;
+            p = line = stop;
+        }
+    }
+
     int i;
-    for (i = 0; i < E.num_rows; i++){
-        current += direction;
-        if (current == -1) current = E.num_rows - 1;
-        else if (current == E.num_rows) current = 0;
-
-        Erow *row = &E.row[current];
-        char *match = strstr(row->render, query);
-        if (match){
-            last_match = current;
-            E.cy = current;
-            E.cx = editor_row_rx_to_cx(row, match - row->render);
-            E.row_off = E.num_rows;
-
-            saved_hl_line = current;
-            saved_hl = malloc(row->rsize);
-            memcpy(saved_hl, row->hl, row->rsize);
-            memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-            break;
+    for (i = 0; i < njobs; i++){
+        job[i].q = q;
+        job[i].m = m;
+        job[i].re = re;
+        job[i].cand = cand;
+        job[i].res.limit = SEARCH_MAX_MATCHES / njobs;
+    }
+    pool_run(search_job, job, sizeof(SearchJob), njobs);
+
+    // Positions past a job that dropped some would leave a gap, so only the
+    // totals are added from there on
+    int complete = res->len == res->total;
+    int64_t row = (from_at && from_row >= E.num_rows) ? from_row : E.num_rows;
+    for (i = 0; i < njobs; i++){
+        SearchResults *part = &job[i].res;
+        int64_t base = i >= map_job ? row : 0;
+        int j;
+        for (j = 0; complete && j < part->len; j++){
+            if (res->len == SEARCH_MAX_MATCHES){
+                complete = 0;
+                break;
+            }
+            search_add(res, part->match[j].at, part->match[j].len, part->match[j].row + base);
+            res->total--;
+        }
+        if (part->len < part->total) complete = 0;
+        res->total += part->total;
+        if (i >= map_job) row += job[i].lines;
+        free(part->match);
+    }
+    free(job);
+    free(cand);
+}
+
+// Drops every match overlapping the one kept before it, returns how many are left
+int search_disjoint(SearchResults *res){
+    int i, n = 0;
+    for (i = 0; i < res->len; i++){
+        SearchMatch *match = &res->match[i];
+        if (n && res->match[n - 1].row == match->row && match->at < res->match[n - 1].at + res->match[n - 1].len) continue;
+        res->match[n++] = *match;
+    }
+    return n;
+}
+
+// Fills res with the matches in prev, found for the first m - 1 bytes of q,
+// that go on to match all of q. A capped prev only holds the matches up to
+// its last one, past that the buffer is searched again
+void search_narrow(SearchResults *res, SearchResults *prev, const char *q, size_t m){
+    res->len = 0;
+    res->total = 0;
+    int i;
+    for (i = 0; i < prev->len; i++){
+        const char *at = prev->match[i].at;
+        // The byte after a row is its line ending or the '\0' after chars,
+        // neither of which a query holds, except at the very end of the map
+        if (E.map && at >= E.map && at < E.map + E.map_len && (size_t)(E.map + E.map_len - at) < m) continue;
+        if (at[m - 1] == q[m - 1]) search_add(res, at, m, prev->match[i].row);
+    }
+    if (prev->len < prev->total){
+        SearchMatch *last = &prev->match[prev->len - 1];
+        search_buffer(res, q, m, NULL, last->row, last->at + 1);
+    }
+}
+
+//---find---
+void editor_find_callback(char *query, int key){
+    // level[k] holds the matches of the first k + 1 bytes of last_query
+    static SearchResults *level = NULL;
+    static int nlevel = 0, level_cap = 0;
+    static char *last_query = NULL;
+
+    E.match_row = -1;
+
+
+    if (key == '\r' || key == '\x1b'){
+        int k;
+        for (k = 0; k < level_cap; k++) free(level[k].match);
+        free(level);
+        level = NULL;
+        nlevel = level_cap = 0;
+        free(last_query);
+        last_query = NULL;
+        E.match_cur = -1;
+        return;
+    }else if (key == CTRL_KEY('e')){
+        E.match_regex = !E.match_regex;
+        free(last_query);
+        last_query = NULL;
+        nlevel = 0;
+    }
+
+    int qlen = strlen(query);
+    if (last_query == NULL || strcmp(query, last_query)){
+        if (qlen > level_cap){
+            level = realloc(level, sizeof(SearchResults) * qlen);
+            if (level == NULL) die("realloc");
+            memset(&level[level_cap], 0, sizeof(SearchResults) * (qlen - level_cap));
+            level_cap = qlen;
+        }
+        if (E.match_regex){
+            // A longer pattern doesn't narrow a shorter one, it is searched afresh
+            Regex *re = qlen ? regex_compile(query) : NULL;
+            nlevel = 0;
+            if (re){
+                search_buffer(&level[0], NULL, 0, re, 0, NULL);
+                nlevel = 1;
+            }
+            regex_free(re);
+        }else{
+            // Levels for the prefix both queries share stay valid, every byte
+            // past it narrows the level before instead of searching again
+            int keep = 0;
+            while (last_query && keep < nlevel && query[keep] == last_query[keep]) keep++;
+            int k;
+            for (k = keep; k < qlen; k++){
+                if (k == 0){
+                    search_buffer(&level[k], query, k + 1, NULL, 0, NULL);
+                }else{
+                    search_narrow(&level[k], &level[k - 1], query, k + 1);
+                }
+            }
+            nlevel = qlen;
         }
+        free(last_query);
+        last_query = strdup(query);
+        E.match_cur = 0;
+    }
+
+    SearchResults *res = nlevel ? &level[nlevel - 1] : NULL;
+    E.match_total = res ? res->total : 0;
+    if (res == NULL || res->len == 0) return;
+
+    // Arrows step through the matches already found
+    if (key == ARROW_RIGHT || key == ARROW_DOWN){
+        E.match_cur = (E.match_cur + 1) % res->len;
+    }else if (key == ARROW_LEFT || key == ARROW_UP){
+        E.match_cur = (E.match_cur + res->len - 1) % res->len;
     }
 
+    SearchMatch *match = &res->match[E.match_cur];
+    editor_index_rows(match->row);
+    E.cy = match->row;
+    E.cx = match->at - editor_row(E.cy)->chars;
+    E.row_off = E.num_rows;
+
+    Erow *row = editor_row_rendered(E.cy);
+    int64_t rx = editor_row_cx_to_rx(row, E.cx);
+    int64_t len = editor_row_cx_to_rx(row, E.cx + match->len) - rx;
+    E.match_row = E.cy;
+    E.match_rx = rx;
+    E.match_len = len;
 }
 
 void editor_find(){
-    int saved_cx = E.cx;
-    int saved_cy = E.cy;
-    int saved_col_off = E.col_off;
-    int saved_row_off = E.row_off;
+    int64_t saved_cx = E.cx;
+    int64_t saved_cy = E.cy;
+    int64_t saved_col_off = E.col_off;
+    int64_t saved_row_off = E.row_off;
 
-    char *query = editor_prompt("Search: %s (Use ESC/Arrows/Enter)", editor_find_callback);
+    char *query = editor_prompt("Search: %s (Use ESC/Arrows/Enter, Ctrl-E = regex)", editor_find_callback);
     if (query) {
         free(query);
     }else{
@@ -730,31 +4261,455 @@ void editor_find(){
   
 }
 
-//---append buffer---
+// Replaces n non overlapping matches, in buffer order, with s. Each touched
+// row gets its new chars in one go and is rebuilt once. Returns where the last
+// replacement ends in its row
+const char *editor_replace_matches(SearchMatch *match, int n, const char *s, int64_t len){
+    editor_index_rows(match[n - 1].row);
+    const char *last = NULL;
+    int i = 0;
+    while (i < n){
+        int64_t at = match[i].row;
+        int64_t size = editor_row(at)->size;
+        int j;
+        for (j = i; j < n && match[j].row == at; j++) size += len - match[j].len;
+
+        Erow *row = editor_row(at);
+        int64_t shift = 0, k;
+        for (k = i; k < j; k++){
+            int64_t pos = match[k].at - row->chars + shift;
+            undo_log(UNDO_DELETE, at, pos, match[k].at, match[k].len);
+            undo_log(UNDO_INSERT, at, pos, s, len);
+            shift += len - match[k].len;
+        }
+        int64_t cap = slab_size(size + 1);
+        char *chars = slab_alloc(cap);
+        char *to = chars;
+        const char *from = row->chars;
+        for (; i < j; i++){
+            memcpy(to, from, match[i].at - from);
+            to += match[i].at - from;
+            memcpy(to, s, len);
+            to += len;
+            from = match[i].at + match[i].len;
+        }
+        memcpy(to, from, row->chars + row->size - from);
+        chars[size] = '\0';
+        last = to;
+
+        if (!(row->flags & ROW_MAPPED)) slab_free(row->chars, row->cap);
+        row->flags &= ~ROW_MAPPED;
+        row->chars = chars;
+        row->cap = cap;
+        row->size = size;
+        editor_update_row(at);
+        index_add_row(at, 0, size);
+    }
+    E.dirty++;
+    return last;
+}
+
+// Shows a match highlighted and asks what to do with it
+int editor_replace_ask(SearchMatch *match){
+    editor_index_rows(match->row);
+    E.cy = match->row;
+    E.cx = match->at - editor_row(E.cy)->chars;
+    E.row_off = E.num_rows;
+
+    Erow *row = editor_row_rendered(E.cy);
+    int64_t rx = editor_row_cx_to_rx(row, E.cx);
+    int64_t len = editor_row_cx_to_rx(row, E.cx + match->len) - rx;
+    E.match_row = E.cy;
+    E.match_rx = rx;
+    E.match_len = len;
+
+    editor_set_status_message("Replace this match? (y)es (n)o (a)ll ESC = stop");
+    editor_refresh_screen();
+    int key = editor_read_key();
+
+    E.match_row = -1;
+    return key;
+}
+
+void editor_replace(){
+    int64_t saved_cx = E.cx;
+    int64_t saved_cy = E.cy;
+    int64_t saved_col_off = E.col_off;
+    int64_t saved_row_off = E.row_off;
+
+    char *query = editor_prompt("Replace: %s (Use ESC/Arrows/Enter, Ctrl-E = regex)", editor_find_callback);
+    char *with = query ? editor_prompt("Replace with: %s (ESC to cancel)", NULL) : NULL;
+    if (with == NULL){
+        free(query);
+        E.cx = saved_cx;
+        E.cy = saved_cy;
+        E.col_off = saved_col_off;
+        E.row_off = saved_row_off;
+        editor_set_status_message("Replace aborted");
+        return;
+    }
+
+    Regex *re = NULL;
+    if (E.match_regex && (re = regex_compile(query)) == NULL){
+        editor_set_status_message("Bad regex: %s", query);
+        free(query);
+        free(with);
+        return;
+    }
+
+    size_t m = strlen(query);
+    int64_t len = strlen(with);
+    SearchResults res = {0};
+    long replaced = 0;
+    int all = 0;
+    int64_t from_row = 0;
+    const char *from_at = NULL;
+    while (1){
+        res.len = 0;
+        res.total = 0;
+        search_buffer(&res, query, m, re, from_row, from_at);
+        int capped = res.len < res.total;
+        int n = search_disjoint(&res);
+        if (n == 0) break;
+
+        // One at a time until all is picked, then the rest goes in one batch
+        int i = 0, key = 'a';
+        for (; !all && i < n; i++){
+            key = editor_replace_ask(&res.match[i]);
+            if (key == 'y' || key == 'a' || key == '\x1b') break;
+        }
+        if (key == '\x1b') break;
+        if (i == n){
+            if (!capped) break;
+            from_row = res.match[n - 1].row;
+            from_at = res.match[n - 1].at + res.match[n - 1].len;
+            continue;
+        }
+        if (key == 'a') all = 1;
+
+        int count = all ? n - i : 1;
+        from_row = res.match[i + count - 1].row;
+        from_at = editor_replace_matches(&res.match[i], count, with, len);
+        replaced += count;
+        E.cy = from_row;
+        E.cx = from_at - editor_row(from_row)->chars;
+        if (all && !capped) break;
+    }
+    free(res.match);
+    regex_free(re);
+    editor_set_status_message("Replaced %ld occurrence%s", replaced, replaced == 1 ? "" : "s");
+    free(query);
+    free(with);
+}
+
+//---append buffer---
+
+// Kept across frames, so once it has grown to fit a frame nothing is allocated
+typedef struct{
+    char *b;
+    int64_t len;
+    int64_t cap;
+}Abuf;
+
+#define ABUF_INIT {NULL, 0, 0}
+
+long ab_reallocs; // times any buffer had to grow
+
+// Makes room for len more bytes and returns where they go
+char *ab_reserve(Abuf *ab, int64_t len){
+    if (ab->len + len > ab->cap){
+        int64_t cap = ab->cap ? ab->cap : 4096;
+        while (cap < ab->len + len) cap *= 2;
+        char *new = realloc(ab->b, cap);
+        if (new == NULL) die("realloc");
+        ab->b = new;
+        ab->cap = cap;
+        ab_reallocs++;
+    }
+    char *at = &ab->b[ab->len];
+    ab->len += len;
+    return at;
+}
+
+void ab_append(Abuf *ab, const char *s, int64_t len){
+    memcpy(ab_reserve(ab, len), s, len);
+}
+
+void ab_free(Abuf *ab){
+    free(ab->b);
+}
+
+//---screen---
+#define ATTR_DEFAULT 39 // foreground color code
+#define ATTR_INVERSE (1<<7)
+#define SCREEN_GAP 4 // unchanged cells cheaper to rewrite than to jump over
+#define FRAME_MS 16 // least time between frames drawn while keys are queued
+
+// A frame of cells, the bytes and their color codes, ATTR_INVERSE on top, kept
+// apart so runs of either are copied and compared in bulk
+typedef struct Frame{
+    char *c;
+    unsigned char *attr;
+}Frame;
+
+// The frame being drawn and the one the terminal shows, which the new frame is
+// diffed against so only the cells that changed get written
+typedef struct Screen{
+    int rows, cols; // text rows plus the two bars
+    Frame cur;
+    Frame prev;
+    int drawn; // prev is on the terminal, 0 repaints it all
+    int64_t row_off; // editor_top_line() of prev
+    volatile sig_atomic_t resized; // SIGWINCH came in
+    int y, x; // terminal cursor, x is -1 when unknown
+    int attr; // terminal attribute, -1 when unknown
+    Abuf out; // the frame's output, reused
+    long frames;
+    long skipped; // frames left out as more keys were already queued
+    double last_frame; // when the last frame was drawn, in seconds
+    long bytes; // written over all frames
+    int64_t last_bytes;
+}Screen;
+
+Screen screen;
+
+// The foreground color sequences, by color code from 30
+const char sgr_color[10][6] = {
+    "\x1b[30m", "\x1b[31m", "\x1b[32m", "\x1b[33m", "\x1b[34m",
+    "\x1b[35m", "\x1b[36m", "\x1b[37m", "\x1b[38m", "\x1b[39m"
+};
+
+void screen_blank(Frame *f, int from, int n){
+    memset(&f->c[from], ' ', n);
+    memset(&f->attr[from], ATTR_DEFAULT, n);
+}
+
+// Starts a frame of blank cells, resizing the frames if the window changed
+void screen_begin(){
+    int rows = E.screen_rows + 2, cols = E.screen_cols;
+    if (rows != screen.rows || cols != screen.cols){
+        Frame *f[2] = {&screen.cur, &screen.prev};
+        int i;
+        for (i = 0; i < 2; i++){
+            free(f[i]->c);
+            free(f[i]->attr);
+            f[i]->c = malloc(rows * cols);
+            f[i]->attr = malloc(rows * cols);
+            if (f[i]->c == NULL || f[i]->attr == NULL) die("malloc");
+        }
+        screen.rows = rows;
+        screen.cols = cols;
+        screen.drawn = 0;
+    }
+    screen_blank(&screen.cur, 0, rows * cols);
+}
+
+// Writes s at x of row y of the frame being drawn, dropping what runs off it
+int screen_puts(int y, int x, const char *s, int len, int attr){
+    if (len > screen.cols - x) len = screen.cols - x;
+    if (len <= 0) return x;
+    memcpy(&screen.cur.c[y * screen.cols + x], s, len);
+    memset(&screen.cur.attr[y * screen.cols + x], attr, len);
+    return x + len;
+}
+
+// Fills row y of the frame being drawn with blanks in attr
+void screen_fill(int y, int attr){
+    memset(&screen.cur.attr[y * screen.cols], attr, screen.cols);
+}
+
+// A row holding bytes past ascii may not take a column per byte on the
+// terminal, so it is never patched, only redrawn whole
+int screen_row_plain(Frame *f, int y){
+    const unsigned char *c = (const unsigned char *)&f->c[y * screen.cols];
+    unsigned char bits = 0;
+    int x;
+    for (x = 0; x < screen.cols; x++) bits |= c[x]; // no early out, so it vectorizes
+    return bits < 0x80;
+}
+
+void screen_attr(Abuf *ab, int attr){
+    if (attr == screen.attr) return;
+    if (screen.attr < 0 || ((screen.attr & ATTR_INVERSE) && !(attr & ATTR_INVERSE))){
+        ab_append(ab, "\x1b[m", 3);
+        screen.attr = ATTR_DEFAULT;
+    }
+    if ((attr & ATTR_INVERSE) && !(screen.attr & ATTR_INVERSE)) ab_append(ab, "\x1b[7m", 4);
+    if ((attr & ~ATTR_INVERSE) != (screen.attr & ~ATTR_INVERSE)){
+        ab_append(ab, sgr_color[(attr & ~ATTR_INVERSE) - 30], 5);
+    }
+    screen.attr = attr;
+}
+
+// Moves the terminal cursor with the shortest sequence that gets there
+void screen_move(Abuf *ab, int y, int x){
+    if (screen.x >= 0 && y == screen.y && x == screen.x) return;
+    char buf[32];
+    int len;
+    if (screen.x >= 0 && y == screen.y && x == 0){
+        len = snprintf(buf, sizeof(buf), "\r");
+    }else if (screen.x >= 0 && y == screen.y && x > screen.x){
+        len = x - screen.x == 1 ? snprintf(buf, sizeof(buf), "\x1b[C") :
+            snprintf(buf, sizeof(buf), "\x1b[%dC", x - screen.x);
+    }else if (x == 0){
+        len = snprintf(buf, sizeof(buf), "\x1b[%dH", y + 1);
+    }else{
+        len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+    }
+    ab_append(ab, buf, len);
+    screen.y = y;
+    screen.x = x < screen.cols ? x : -1; // the terminal stops at the last column
+}
+
+// Writes cells from..to of row y, a run of one attribute at a time
+void screen_write(Abuf *ab, int y, int from, int to){
+    const char *c = &screen.cur.c[y * screen.cols];
+    const unsigned char *attr = &screen.cur.attr[y * screen.cols];
+    screen_move(ab, y, from);
+    int x = from;
+    while (x < to){
+        int run = x + 1;
+        while (run < to && attr[run] == attr[x]) run++;
+        screen_attr(ab, attr[x]);
+        ab_append(ab, &c[x], run - x);
+        x = run;
+    }
+    // The cursor waits past the last column until the next byte wraps it
+    screen.x = to < screen.cols ? to : -1;
+}
+
+// When the text scrolled by less than a screen, has the terminal scroll the
+// text rows so the rows still shown are moved rather than rewritten
+void screen_scroll(Abuf *ab){
+    int64_t top = editor_top_line();
+    int64_t delta = top - screen.row_off;
+    screen.row_off = top;
+    if (!screen.drawn || delta == 0 || delta >= E.screen_rows || -delta >= E.screen_rows) return;
+    int d = (int)delta;
+
+    char buf[32];
+    int len;
+    screen_attr(ab, ATTR_DEFAULT);
+    len = snprintf(buf, sizeof(buf), "\x1b[1;%dr", E.screen_rows);
+    ab_append(ab, buf, len);
+    len = snprintf(buf, sizeof(buf), "\x1b[%d%c", d > 0 ? d : -d, d > 0 ? 'S' : 'T');
+    ab_append(ab, buf, len);
+    ab_append(ab, "\x1b[r", 3); // also homes the cursor
+    screen.y = screen.x = 0;
+
+    int n = d > 0 ? d : -d, cols = screen.cols;
+    size_t kept = (size_t)(E.screen_rows - n) * cols;
+    if (d > 0){
+        memmove(screen.prev.c, &screen.prev.c[n * cols], kept);
+        memmove(screen.prev.attr, &screen.prev.attr[n * cols], kept);
+        screen_blank(&screen.prev, kept, n * cols);
+    }else{
+        memmove(&screen.prev.c[n * cols], screen.prev.c, kept);
+        memmove(&screen.prev.attr[n * cols], screen.prev.attr, kept);
+        screen_blank(&screen.prev, 0, n * cols);
+    }
+}
+
+// Appends what turns the terminal's frame into the new one: each changed run
+// of cells, with short unchanged gaps written through, and an erase for a
+// tail that went blank
+void screen_diff(Abuf *ab){
+    int y, x;
+    if (!screen.drawn){
+        ab_append(ab, "\x1b[m\x1b[2J", 7);
+        screen.attr = ATTR_DEFAULT;
+        screen.x = -1;
+        screen_blank(&screen.prev, 0, screen.rows * screen.cols);
+        screen.drawn = 1;
+    }
+    screen_scroll(ab);
+
+    for (y = 0; y < screen.rows; y++){
+        int row = y * screen.cols;
+        const char *c = &screen.cur.c[row];
+        const unsigned char *attr = &screen.cur.attr[row];
+        const char *pc = &screen.prev.c[row];
+        const unsigned char *pattr = &screen.prev.attr[row];
+        if (!memcmp(c, pc, screen.cols) && !memcmp(attr, pattr, screen.cols)) continue;
+        int tail = screen.cols;
+        while (tail > 0 && c[tail - 1] == ' ' && attr[tail - 1] == ATTR_DEFAULT) tail--;
+        int clear = 0;
+        for (x = tail; x < screen.cols && !clear; x++) clear = c[x] != pc[x] || attr[x] != pattr[x];
+
+        if (!screen_row_plain(&screen.cur, y) || !screen_row_plain(&screen.prev, y)){
+            screen_move(ab, y, 0);
+            screen_attr(ab, ATTR_DEFAULT);
+            ab_append(ab, "\x1b[2K", 4);
+            screen_write(ab, y, 0, tail);
+            screen.x = -1;
+            continue;
+        }
+
+        int end = clear ? tail : screen.cols;
+        x = 0;
+        while (x < end){
+            if (c[x] == pc[x] && attr[x] == pattr[x]){
+                x++;
+                continue;
+            }
+            int from = x, to = x + 1;
+            for (x = to; x < end && x - to < SCREEN_GAP; x++){
+                if (c[x] != pc[x] || attr[x] != pattr[x]) to = x + 1;
+            }
+            screen_write(ab, y, from, to);
+            x = to;
+        }
+        if (clear){
+            screen_move(ab, y, tail);
+            screen_attr(ab, ATTR_DEFAULT);
+            ab_append(ab, "\x1b[K", 3);
+        }
+    }
 
-typedef struct{
-    char *b;
-    int len;
-}Abuf;
+    Frame swap = screen.prev;
+    screen.prev = screen.cur;
+    screen.cur = swap;
+}
 
-#define ABUF_INIT {NULL, 0}
+//---output---
+// Wrapped screen line of the cursor, counted from the top of the file
+int64_t editor_cursor_vline(){
+    int64_t v = rope_vline(E.cy);
+    if (E.cy < E.num_rows){
+        // At the end of a row that fills its last line the cursor stays on it
+        int64_t sub = E.rx / E.screen_cols, vlines = editor_row(E.cy)->vlines;
+        v += sub < vlines ? sub : vlines - 1;
+    }
+    return v;
+}
 
-void ab_append(Abuf *ab, const char *s, int len){
-    char *new = realloc(ab->b, ab->len + len);
-    memcpy(&new[ab->len], s, len);
-    ab->b = new;
-    ab->len += len;
+// Topmost screen line, in wrapped lines with soft wrap on
+int64_t editor_top_line(){
+    return E.wrap ? rope_vline(E.row_off) + E.wrap_off : E.row_off;
 }
 
-void ab_free(Abuf *ab){
-    free(ab->b);
+// With soft wrap on the screen scrolls by wrapped lines, found through the
+// line counts the rope keeps next to its row counts
+void editor_wrap_scroll(){
+    E.col_off = 0;
+    int64_t cur = editor_cursor_vline();
+    int64_t top = editor_top_line();
+    if (cur < top) top = cur;
+    if (cur >= top + E.screen_rows) top = cur - E.screen_rows + 1;
+    E.row_off = rope_vline_row(top, &E.wrap_off);
+    E.cur_y = cur - top;
+    E.cur_x = E.rx - (cur - rope_vline(E.cy)) * E.screen_cols;
 }
 
-//---output---
 void editor_scroll(){
+    editor_index_rows(E.row_off + E.screen_rows);
     E.rx = 0;
     if (E.cy < E.num_rows){
-        E.rx = editor_row_cx_to_rx(&E.row[E.cy], E.cx);
+        E.rx = editor_row_cx_to_rx(editor_row(E.cy), E.cx);
+    }
+    if (E.wrap){
+        editor_wrap_scroll();
+        return;
     }
 
     if (E.cy < E.row_off){
@@ -770,12 +4725,66 @@ void editor_scroll(){
     if (E.rx > E.col_off + E.screen_cols){
         E.col_off = E.rx - E.screen_cols + 1;
     }
+    E.cur_y = E.cy - E.row_off;
+    E.cur_x = E.rx - E.col_off;
+}
+
+// Puts screen columns [j, end) in one highlight, control chars inverted
+void editor_draw_run(int y, const char *c, int j, int end, int h){
+    int attr = h == HL_NORMAL ? ATTR_DEFAULT : editor_syntax_to_color(h);
+    while (j < end){
+        int run = j;
+        while (run < end && !iscntrl(c[run])) run++;
+        if (run > j) screen_puts(y, j, &c[j], run - j, attr);
+        if (run < end){
+            char sym = (c[run] <= 26) ? '@' + c[run] : '?';
+            screen_puts(y, run, &sym, 1, attr | ATTR_INVERSE); //invert colors
+            run++;
+        }
+        j = run;
+    }
+}
+
+// Draws one screen line of a row, the columns from `from` on, a run of one
+// highlight at a time
+void editor_draw_row(int y, int64_t file_row, Erow *row, int64_t from){
+    RowView *v = row->view;
+    int64_t avail = v->rsize - from;
+    int len = avail < 0 ? 0 : avail > E.screen_cols ? E.screen_cols : (int)avail;
+    char *c = &editor_row_render(row)[from];
+
+    const unsigned char *spans = editor_row_spans(v);
+    int64_t col;
+    int64_t off = hl_span_seek(v, from, &col);
+
+    // The current match goes over the runs it falls in
+    int64_t ma = -1, mb = -1;
+    if (file_row == E.match_row){
+        ma = E.match_rx - from;
+        mb = ma + E.match_len;
+    }
+    int j = 0, h;
+    while (j < len && off < v->hl_len){
+        col += hl_span_next(spans, &off, &h);
+        int end = col - from < len ? (int)(col - from) : len;
+        while (j < end){
+            int cut = end, k = h;
+            if (j < ma){
+                if (ma < cut) cut = ma;
+            }else if (j < mb){
+                k = HL_MATCH;
+                if (mb < cut) cut = mb;
+            }
+            editor_draw_run(y, c, j, cut, k);
+            j = cut;
+        }
+    }
 }
 
-void editor_draw_rows(Abuf *ab){
+void editor_draw_rows(){
     int y;
+    int64_t file_row = E.row_off, sub = E.wrap ? E.wrap_off : 0;
     for (y = 0; y < E.screen_rows; y++){
-        int file_row = y + E.row_off;
         if (file_row >= E.num_rows){
             
             // Show version info
@@ -786,120 +4795,117 @@ void editor_draw_rows(Abuf *ab){
 
                 if (welcomelen > E.screen_cols) welcomelen = E.screen_cols;
                 int padding = (E.screen_cols - welcomelen) / 2;
-                if (padding != 0){
-                    ab_append(ab, "~", 1);
-                    padding--;
-                }
-                while (padding-- != 0) {
-                    ab_append(ab, " ", 1);
-                }
-
-                ab_append(ab, welcome, welcomelen);
+                screen_puts(y, 0, "~", 1, ATTR_DEFAULT);
+                screen_puts(y, padding, welcome, welcomelen, ATTR_DEFAULT);
             }else{
-                ab_append(ab, "~", 1);
+                screen_puts(y, 0, "~", 1, ATTR_DEFAULT);
             }
 
+        }else if (E.wrap){
+            Erow *row = editor_row_rendered(file_row);
+            editor_draw_row(y, file_row, row, sub * E.screen_cols);
+            if (++sub < row->vlines) continue;
+            sub = 0;
         }else{
-            int len = E.row[file_row].rsize - E.col_off;
-            if (len < 0) len = 0;
-            if (len > E.screen_cols) len = E.screen_cols;
-            
-            char *c = &E.row[file_row].render[E.col_off];
-            unsigned char *hl = &E.row[file_row].hl[E.col_off];
-            int current_color = -1;
-            int j;
-            for (j = 0; j < len; j++){
-                if (iscntrl(c[j])){
-                    char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-                    ab_append(ab, "\x1b[7m", 4); //invert colors
-                    ab_append(ab, &sym, 1);
-                    ab_append(ab, "\x1b[m", 3); // reset colors
-                    // Need to set color back after reset
-                    if (current_color != -1){
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-                        ab_append(ab, buf, clen);
-                    }
-
-                }else if (hl[j] == HL_NORMAL){
-                    if (current_color != -1){
-                        ab_append(ab, "\x1b[39m", 5);
-                        current_color = -1;
-                    }
-                    ab_append(ab, &c[j], 1);
-                }else{
-                    int color = editor_syntax_to_color(hl[j]);
-                    if (color != current_color){
-                        current_color = color;
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-                        ab_append(ab, buf, clen);
-                    }
-                    ab_append(ab, &c[j], 1);
-                }
-
-            }
-            ab_append(ab, "\x1b[39m", 5); // reset to default color
+            editor_draw_row(y, file_row, editor_row_rendered(file_row), E.col_off);
         }
-
-        ab_append(ab, "\x1b[K", 3);
-        ab_append(ab, "\r\n", 2);
-        
+        file_row++;
     }
 }
 
-void editor_draw_status_bar(Abuf *ab){
-    ab_append(ab, "\x1b[7m", 4); // Inverted colors
+void editor_draw_status_bar(){
+    int attr = ATTR_DEFAULT | ATTR_INVERSE; // Inverted colors
     char status[80], rstatus[80];
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-        E.filename ? E.filename : "[No Name]", E.num_rows,
-        E.dirty ? "(modified)" : "");
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d", 
-        E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.num_rows);
+    int64_t total = editor_total_rows();
+    int len = snprintf(status, sizeof(status), "%.20s - %" PRId64 "%s lines %s",
+        E.filename ? E.filename : "[No Name]", total,
+        E.map_off < E.map_len && loader.seen < E.map_len ? "+" : "", E.dirty ? "(modified)" : "");
+    if (loader.running){
+        len += snprintf(&status[len], sizeof(status) - len, "%sloading %d%%",
+            E.dirty ? " " : "", (int)(loader.seen * 100 / E.map_len));
+    }
+    int rlen = E.match_cur < 0 ?
+        snprintf(rstatus, sizeof(rstatus), "%s | %" PRId64 "/%" PRId64,
+            E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, total) :
+        snprintf(rstatus, sizeof(rstatus), "%s | %s %ld/%ld",
+            E.syntax ? E.syntax->filetype : "no ft", E.match_regex ? "regex" : "match",
+            E.match_total ? E.match_cur + 1L : 0L, E.match_total);
     
     if (len > E.screen_cols) len = E.screen_cols;
-    ab_append(ab, status, len);
-    while (len < E.screen_cols){
-        if (E.screen_cols - len == rlen){
-            ab_append(ab, rstatus, rlen);
-            break;
-        }else{
-            ab_append(ab, " ", 1);
-            len++;
-        }
+    screen_fill(E.screen_rows, attr);
+    screen_puts(E.screen_rows, 0, status, len, attr);
+    if (E.screen_cols - len >= rlen){
+        screen_puts(E.screen_rows, E.screen_cols - rlen, rstatus, rlen, attr);
     }
-    ab_append(ab, "\x1b[m", 3); // reset inverted colors
-    ab_append(ab, "\r\n", 2);
 }
 
-void editor_draw_message_bar(Abuf *ab){
-    ab_append(ab, "\x1b[K", 3);
+void editor_draw_message_bar(){
     int msg_len = strlen(E.statusmsg);
     if (msg_len > E.screen_cols) msg_len = E.screen_cols;
-    if (msg_len && time(NULL) - E.statusmsg_time < 5)
-        ab_append(ab, E.statusmsg, msg_len);
+    if (msg_len && time(NULL) - E.statusmsg_time < MESSAGE_SECS)
+        screen_puts(E.screen_rows + 1, 0, E.statusmsg, msg_len, ATTR_DEFAULT);
 }
 
-void editor_refresh_screen(){
+// Draws a frame and appends what brings the terminal up to date with it
+void editor_render(Abuf *ab){
     editor_scroll();
 
-    Abuf ab = ABUF_INIT;
+    screen_begin();
+    editor_draw_rows();
+    editor_draw_status_bar();
+    editor_draw_message_bar();
 
-    ab_append(&ab, "\x1b[?25l", 6); // Hide cursor
-    ab_append(&ab, "\x1b[H", 3);
+    ab_append(ab, "\x1b[?25l", 6); // Hide cursor
+    int64_t start = ab->len;
+    screen_diff(ab);
+    int changed = ab->len > start;
+    if (!changed) ab->len = start - 6; // nothing to hide the cursor for
 
-    editor_draw_rows(&ab);
-    editor_draw_status_bar(&ab);
-    editor_draw_message_bar(&ab);
+    screen_move(ab, E.cur_y, E.cur_x);
+    if (changed) ab_append(ab, "\x1b[?25h", 6); // Show cursor
+}
 
-    char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", 
-            (E.cy - E.row_off) + 1, (E.rx - E.col_off) + 1);
-    ab_append(&ab, buf, strlen(buf));
-    ab_append(&ab, "\x1b[?25h", 6); // Show cursor
+void handle_winch(int sig){
+    (void)sig;
+    screen.resized = 1;
+}
+
+// Takes the terminal's new size, the next frame repaints all of it
+void editor_resize(){
+    screen.resized = 0;
+    if (get_window_size(&E.screen_rows, &E.screen_cols) == -1) die("get_window_size");
+    E.screen_rows -= 2;
+    screen.drawn = 0;
+    if (E.wrap) editor_wrap_count(E.root);
+}
 
-    write(STDOUT_FILENO, ab.b, ab.len);
-    ab_free(&ab);
+void editor_refresh_screen(){
+    if (screen.resized) editor_resize();
+    screen.out.len = 0;
+    editor_render(&screen.out);
+
+    write(STDOUT_FILENO, screen.out.b, screen.out.len);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    screen.last_frame = ts.tv_sec + ts.tv_nsec / 1e9;
+    screen.frames++;
+    screen.bytes += screen.out.len;
+    screen.last_bytes = screen.out.len;
+}
+
+// Refreshes the screen unless more keys are already queued, so a burst of
+// them is drained first. A frame still goes out every FRAME_MS during a long
+// burst, and always once the keys run out, before waiting for more
+void editor_schedule_refresh(){
+    if (input_pending()){
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        if (ts.tv_sec + ts.tv_nsec / 1e9 - screen.last_frame < FRAME_MS / 1e3){
+            screen.skipped++;
+            return;
+        }
+    }
+    editor_refresh_screen();
 }
 
 void editor_set_status_message(const char *fmt, ...){
@@ -914,13 +4920,14 @@ void editor_set_status_message(const char *fmt, ...){
 char *editor_prompt(char *prompt, void (*callback)(char *, int)){
     size_t bufsize = 128;
     char *buf = malloc(bufsize);
+    if (buf == NULL) die("malloc");
 
     size_t buflen = 0;
     buf[0] = '\0';
 
     while(1){
         editor_set_status_message(prompt, buf);
-        editor_refresh_screen();
+        editor_schedule_refresh();
 
         int c = editor_read_key();
         if (c == DEL_KEY || c == BACKSPACE){
@@ -936,10 +4943,25 @@ char *editor_prompt(char *prompt, void (*callback)(char *, int)){
                 if (callback) callback(buf, c);
                 return buf;
             }
+        }else if (c == PASTE_START){
+            // Pasted text is typed in, without what the prompt can't take
+            size_t len, i;
+            char *paste = editor_read_paste(&len);
+            if (buflen + len >= bufsize){
+                bufsize = buflen + len + 1;
+                buf = realloc(buf, bufsize);
+                if (buf == NULL) die("realloc");
+            }
+            for (i = 0; i < len; i++){
+                if (!iscntrl((unsigned char)paste[i]) && (unsigned char)paste[i] < 128) buf[buflen++] = paste[i];
+            }
+            buf[buflen] = '\0';
+            free(paste);
         }else if (!iscntrl(c) && c < 128){
             if (buflen == bufsize -1){
                 bufsize *= 2;
                 buf = realloc(buf, bufsize);
+                if (buf == NULL) die("realloc");
             }
             buf[buflen++] = c; // same as buf[buflen] = c; buflen++;
             buf[buflen] = '\0';
@@ -951,7 +4973,8 @@ char *editor_prompt(char *prompt, void (*callback)(char *, int)){
 }
 
 void editor_move_cursor(int key){
-    Erow *row = (E.cy >= E.num_rows) ? NULL : &E.row[E.cy];
+    editor_index_rows(E.cy + 1);
+    Erow *row = (E.cy >= E.num_rows) ? NULL : editor_row(E.cy);
 
     switch (key){
         case ARROW_LEFT:
@@ -959,7 +4982,7 @@ void editor_move_cursor(int key){
                 E.cx--;
             }else if (E.cy > 0){
                 E.cy--;
-                E.cx = E.row[E.cy].size;
+                E.cx = editor_row(E.cy)->size;
             }
             break;
         case ARROW_RIGHT:
@@ -982,17 +5005,71 @@ void editor_move_cursor(int key){
             break;
     }
 
-    row = (E.cy > E.num_rows) ? NULL : &E.row[E.cy];
-    int row_len = row ? row->size : 0;
+    row = (E.cy >= E.num_rows) ? NULL : editor_row(E.cy);
+    int64_t row_len = row ? row->size : 0;
     if (E.cx > row_len){
         E.cx = row_len;
     }
 }
 
+// Ctrl-T cycles through the screen output, input, highlight worker and trigram
+// index stats
+void editor_show_stats(){
+    static int page = 0;
+    page = (page + 1) % 4;
+    if (page == 3){
+        if (!hl.running){
+            editor_set_status_message("Highlight: no worker, every row lexed on the main thread");
+            return;
+        }
+        editor_set_status_message("Highlight: %" PRId64 " of %" PRId64 " rows known, %ld batches, %ld discarded, %d marks",
+            hl_next() < E.num_rows ? hl_next() : E.num_rows, E.num_rows, hl.batches, hl.discarded, E.hl_ndirty);
+        return;
+    }
+    if (page == 2){
+        editor_set_status_message("Input: %ld keys from %ld reads, %.1f keys per read",
+            input.keys, input.reads, input.reads ? (double)input.keys / input.reads : 0.0);
+        return;
+    }
+    if (page == 1){
+        editor_set_status_message("Screen: %ld frames, %ld skipped, %" PRId64 " bytes last, %.0f avg, %.1f KB total",
+            screen.frames, screen.skipped, screen.last_bytes,
+            screen.frames ? (double)screen.bytes / screen.frames : 0.0, screen.bytes / 1024.0);
+        return;
+    }
+
+    if (tindex.nblocks == 0){
+        editor_set_status_message("Index: none, only kept for files of %d MB or more", INDEX_MIN_BYTES >> 20);
+        return;
+    }
+    if (!index_ready()){
+        pthread_mutex_lock(&tindex.lock);
+        int built = tindex.built;
+        pthread_mutex_unlock(&tindex.lock);
+        editor_set_status_message("Index: building, %d%% of %d blocks", built * 100 / tindex.nblocks, tindex.nblocks);
+        return;
+    }
+
+    size_t bytes = sizeof(Posting) * (tindex.mask + 1) + (sizeof(size_t) + sizeof(int)) * tindex.nblocks;
+    long postings = 0;
+    unsigned int i;
+    for (i = 0; i <= tindex.mask; i++){
+        if (tindex.slot[i].tri == TRIGRAM_NONE) continue;
+        bytes += sizeof(int) * tindex.slot[i].cap;
+        postings += tindex.slot[i].len;
+    }
+    editor_set_status_message("Index: %d blocks, %d trigrams, %ld postings, %.1f MB, built in %.2fs",
+        tindex.nblocks, tindex.used, postings, bytes / 1048576.0, tindex.build_time);
+}
+
 void editor_process_keypress(){
     static int quit_times = QUIT_TIMES;
     int c = editor_read_key();
 
+    if (c == BACKSPACE || c == CTRL_KEY('h') || c == DEL_KEY) undo_begin(UNDO_KEY_DELETE);
+    else if (c == '\t' || (c >= 0 && c < 256 && !iscntrl(c))) undo_begin(UNDO_KEY_TYPE);
+    else undo_begin(UNDO_KEY_OTHER);
+
     switch(c){
         // Enter Key
         case '\r':
@@ -1020,6 +5097,37 @@ void editor_process_keypress(){
             editor_find();
             break;
 
+        case CTRL_KEY('r'):
+            editor_replace();
+            break;
+
+        case CTRL_KEY('t'):
+            editor_show_stats();
+            break;
+
+        case CTRL_KEY('z'):
+            editor_undo();
+            break;
+
+        case CTRL_KEY('y'):
+            editor_redo();
+            break;
+
+        case CTRL_KEY('w'):
+            E.wrap = !E.wrap;
+            editor_wrap_count(E.root);
+            E.wrap_off = 0;
+            screen.drawn = 0;
+            editor_set_status_message("Soft wrap %s", E.wrap ? "on" : "off");
+            break;
+
+        case PASTE_START:
+            editor_paste();
+            break;
+
+        case PASTE_END:
+            break;
+
         case BACKSPACE:
         case CTRL_KEY('h'):
         case DEL_KEY:
@@ -1029,10 +5137,19 @@ void editor_process_keypress(){
 
         case PAGE_UP:
         case PAGE_DOWN:
-            {
+            if (E.wrap){
+                // A screen of wrapped lines, from the top or bottom line
+                editor_index_rows(E.row_off + E.screen_rows * 3);
+                int64_t v = editor_top_line(), sub;
+                v = c == PAGE_UP ? v - E.screen_rows : v + E.screen_rows * 2 - 1;
+                if (v < 0) v = 0;
+                E.cy = rope_vline_row(v, &sub);
+                E.cx = E.cy < E.num_rows ? editor_row_rx_to_cx(editor_row(E.cy), sub * E.screen_cols) : 0;
+            }else{
                if (c == PAGE_UP){
                 E.cy = E.row_off;
                }else if (c == PAGE_DOWN){
+                editor_index_rows(E.row_off + E.screen_rows * 2);
                 E.cy = E.row_off + E.screen_rows - 1;
                 if (E.cy > E.num_rows) E.cy = E.num_rows;
                }
@@ -1059,6 +5176,9 @@ void editor_process_keypress(){
             break;
 
         case CTRL_KEY('l'):
+            screen.drawn = 0; // repaint it all
+            break;
+
         case '\x1b':
             break;
 
@@ -1072,9 +5192,906 @@ void editor_process_keypress(){
             break;
     }
 
+    undo_end();
     quit_times = QUIT_TIMES;
 }
 
+//---benchmarks---
+#ifdef JEDIT_BENCH
+double bench_now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The per keyword loop editor_lex ran before keywords were compiled
+int bench_match_keyword_linear(char **keywords, const char *s, int len, int *klen){
+    int j;
+    for (j = 0; keywords[j] != NULL; j++){
+        int kl = strlen(keywords[j]);
+        int kw2 = keywords[j][kl - 1] == '|';
+        if (kw2) kl--;
+
+        if (kl <= len && !strncmp(s, keywords[j], kl) && (kl == len || is_separator(s[kl]))){
+            *klen = kl;
+            return kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+        }
+    }
+    return HL_NORMAL;
+}
+
+void bench_keywords(){
+    static const char *idents[] = {"x", "value", "self", "items", "result", "i", "count", "data"};
+    static const char *seps[] = {" ", "(", ")", ", ", ".", " = ", ":", "\n"};
+    unsigned int j;
+
+    for (j = 0; j < HLDB_ENTRIES; j++){
+        EditorSyntax *syn = &HLDB[j];
+        int nkw = 0;
+        while (syn->keywords[nkw]) nkw++;
+
+        // A few MB of source-ish text, about a third of the words keywords
+        size_t cap = 4 << 20, len = 0;
+        char *text = malloc(cap + 64);
+        srand(1);
+        while (len < cap){
+            const char *w;
+            int wlen;
+            if (rand() % 3 == 0){
+                w = syn->keywords[rand() % nkw];
+                wlen = strlen(w);
+                if (w[wlen - 1] == '|') wlen--;
+            }else{
+                w = idents[rand() % 8];
+                wlen = strlen(w);
+            }
+            const char *sep = seps[rand() % 8];
+            memcpy(text + len, w, wlen);
+            len += wlen;
+            memcpy(text + len, sep, strlen(sep));
+            len += strlen(sep);
+        }
+
+        KeywordTable *kt = editor_compile_keywords(syn->keywords);
+        long tokens = 0, hits[2] = {0, 0};
+        double t[2];
+        int pass;
+        for (pass = 0; pass < 2; pass++){
+            double start = bench_now();
+            size_t i;
+            int prev_sep = 1;
+            for (i = 0; i < len; i++){
+                if (prev_sep){
+                    int klen = 0;
+                    int kw = pass == 0 ? bench_match_keyword_linear(syn->keywords, text + i, len - i, &klen)
+                                       : editor_match_keyword(kt, text + i, len - i, &klen);
+                    if (pass == 0) tokens++;
+                    if (kw != HL_NORMAL){
+                        hits[pass] += kw + klen;
+                        i += klen - 1;
+                        prev_sep = 0;
+                        continue;
+                    }
+                }
+                prev_sep = kt->sep[(unsigned char)text[i]];
+            }
+            t[pass] = bench_now() - start;
+        }
+
+        printf("keywords %-7s %2d words  linear %7.1f ns/token  compiled %6.1f ns/token  %5.1fx%s\n",
+            syn->filetype, nkw, t[0] * 1e9 / tokens, t[1] * 1e9 / tokens, t[0] / t[1],
+            hits[0] == hits[1] ? "" : "  MISMATCH");
+        editor_free_keywords(kt);
+        free(text);
+    }
+}
+
+// Rare tokens at the end of a buffer of short lines, so every pass reads it
+// all. One starts with a byte the text never has, which suits memchr, the
+// other with its most common one
+void bench_search(char *file_name){
+    static const char *tokens[] = {"xyzzy", "eat!"};
+    size_t len = 256 << 20;
+    char *text = malloc(len);
+    size_t i;
+    srand(1);
+    for (i = 0; i < len; i++) text[i] = (rand() % 40 == 0) ? '\n' : "etaoin shrdlu"[rand() % 13];
+
+    const char *(*impl[5])(const char *, size_t, const char *, size_t);
+    const char *name[5];
+    int n = 0;
+    impl[n] = search_scalar; name[n++] = "scalar";
+#ifdef SEARCH_X86
+    impl[n] = search_sse2; name[n++] = "sse2";
+    if (__builtin_cpu_supports("avx2")){ impl[n] = search_avx2; name[n++] = "avx2"; }
+#endif
+    search_init();
+    impl[n] = search_memmem; name[n++] = "picked";
+    int j, k;
+    for (k = 0; k < 2; k++){
+        size_t m = strlen(tokens[k]);
+        memcpy(text + len - m - 1, tokens[k], m);
+        for (j = 0; j < n; j++){
+            double start = bench_now();
+            const char *p = impl[j](text, len, tokens[k], m);
+            double t = bench_now() - start;
+            printf("search %-6s %-7s %6.2f GB/s%s\n", tokens[k], name[j], len / t / 1e9,
+                p == text + len - m - 1 ? "" : "  MISMATCH");
+        }
+    }
+    free(text);
+
+    // Whole buffer scan of a real file, through the unsplit map and then rows,
+    // for the rare token and for a bit of a line halfway in. Each is searched
+    // with the trigram index put aside and then with it, if the file has one
+    if (file_name){
+        E.root = rope_new_node(1);
+        editor_open(file_name);
+        char mid[9] = "";
+        const char *line = memchr(E.map + E.map_len / 2, '\n', E.map_len / 2);
+        if (line){
+            line++;
+            const char *nl = memchr(line, '\n', E.map + E.map_len - line);
+            int len = nl ? nl - line : 0;
+            if (len > 8) memcpy(mid, line + len / 2 - 4, 8);
+        }
+        if (tindex.nblocks){
+            double start = bench_now();
+            while (!index_ready()) usleep(1000);
+            printf("index  %d blocks  ready after %.2fs  built in %.2fs\n", tindex.nblocks,
+                bench_now() - start, tindex.build_time);
+        }
+        const char *query[2] = {tokens[0], mid};
+        SearchResults res = {0};
+        int pass, k, indexed;
+        for (pass = 0; pass < 2; pass++){
+            if (pass) editor_index_rows(INT64_MAX);
+            for (k = 0; k < 2; k++){
+                for (indexed = 0; indexed <= (tindex.nblocks > 0); indexed++){
+                    TrigramIndex saved = tindex;
+                    if (!indexed) memset(&tindex, 0, sizeof(tindex));
+                    double start = bench_now();
+                    search_buffer(&res, query[k], strlen(query[k]), NULL, 0, NULL);
+                    double t = bench_now() - start;
+                    tindex = saved;
+                    printf("search %-8s %-4s %-7s %8.2f GB/s  %ld matches\n", query[k], pass ? "rows" : "map",
+                        indexed ? "indexed" : "scan", E.map_len / t / 1e9, res.total);
+                }
+            }
+        }
+        free(res.match);
+    }
+}
+
+// Typing into the middle of one long line of C, as minified code has, with
+// render and hl patched per key and then rebuilt per key as edits used to.
+// The patched row is checked against a rebuild, with tabs in it and without
+void bench_edit(){
+    static const char *piece[2] = {"x = foo(12, \"a b\") + bar; /* c */ ", "if (y)\treturn 0.5; /* c */\t"};
+    static const char typed[] = "int k = \"s\";\tf(7); ";
+    E.root = rope_new_node(1);
+    E.match_cur = -1;
+    E.filename = "bench.c";
+    editor_select_syntax_highlight();
+
+    int keys = 2000, t, i;
+    for (t = 0; t < 2; t++){
+        size_t plen = strlen(piece[t]), len = 0;
+        char *line = malloc((1 << 20) + plen);
+        while (len < 1 << 20){
+            memcpy(&line[len], piece[t], plen);
+            len += plen;
+        }
+        editor_insert_row(0, line, len);
+        free(line);
+
+        // Typed, then half of it taken back
+        E.cy = 0;
+        E.cx = len / 2;
+        double start = bench_now();
+        for (i = 0; i < keys; i++){
+            if (i < keys * 3 / 4) editor_insert_char(typed[i % (sizeof(typed) - 1)]);
+            else editor_del_char();
+        }
+        double patched = bench_now() - start;
+
+        Erow *row = editor_row(0);
+        int64_t rsize = row->view->rsize;
+        char *render = malloc(rsize);
+        unsigned char *hl = malloc(rsize);
+        memcpy(render, editor_row_render(row), rsize);
+        editor_row_unpack_hl(row, 0, row->view->hl_len, hl);
+        editor_update_row(0);
+        int same = rsize == row->view->rsize && !memcmp(render, editor_row_render(row), rsize);
+        unsigned char *again = editor_hl_buf(rsize);
+        editor_row_unpack_hl(row, 0, row->view->hl_len, again);
+        same &= !memcmp(hl, again, rsize);
+        free(render);
+        free(hl);
+
+        start = bench_now();
+        for (i = 0; i < keys / 4; i++){
+            editor_row_reserve(row, row->size + 1);
+            memmove(&row->chars[E.cx + 1], &row->chars[E.cx], row->size - E.cx + 1);
+            row->chars[E.cx++] = 'a';
+            row->size++;
+            editor_update_row(0);
+        }
+        double rebuilt = (bench_now() - start) * 4;
+
+        printf("edit   %s 1 MB line  patched %8.0f ns  rebuilt %8.0f ns  per key%s\n", t ? "tabbed" : "plain ",
+            patched * 1e9 / keys, rebuilt * 1e9 / keys, same ? "" : "  MISMATCH");
+
+        // The cursor's column, as each frame wants it, at spots all over the
+        // row, against a scan from the row start
+        int64_t cx[64];
+        for (i = 0; i < 64; i++) cx[i] = (int64_t)rand() % row->size;
+        same = 1;
+        start = bench_now();
+        for (i = 0; i < 6400; i++){
+            int64_t rx = editor_row_cx_to_rx(row, cx[i % 64]);
+            if (i < 64) same &= rx == editor_row_width(row, 0, cx[i], 0) && editor_row_rx_to_cx(row, rx) == cx[i];
+        }
+        double indexed = bench_now() - start;
+        start = bench_now();
+        for (i = 0; i < 640; i++) editor_row_width(row, 0, cx[i % 64], 0);
+        double scanned = (bench_now() - start) * 10;
+        printf("column %s 1 MB line  indexed  %8.0f ns  scanned %8.0f ns  per cx to rx%s\n", t ? "tabbed" : "plain ",
+            indexed * 1e9 / 6400, scanned * 1e9 / 6400, same ? "" : "  MISMATCH");
+        editor_del_row(0);
+    }
+}
+
+// Soft wrap over two million rows of 0 to 300 columns, split off a map as a
+// file would be: counting every row's screen lines, looking lines up both
+// ways against a walk over the rows, and a frame drawn far down
+void bench_wrap(){
+    size_t len = 0, cap = (size_t)2000000 * 160;
+    char *text = malloc(cap);
+    int i;
+    srand(1);
+    for (i = 0; i < 2000000; i++){
+        int n = rand() % 300;
+        memset(&text[len], "etaoin shrdlu"[i % 13], n);
+        if (n > 8) text[len + 3] = '\t';
+        len += n;
+        text[len++] = '\n';
+    }
+    E.root = rope_new_node(1);
+    E.map = text;
+    E.map_len = len;
+    E.map_off = 0;
+    E.match_cur = -1;
+    E.screen_rows = 58;
+    E.screen_cols = 200;
+    editor_index_rows(INT64_MAX);
+
+    E.wrap = 1;
+    double start = bench_now();
+    editor_wrap_count(E.root);
+    double counted = bench_now() - start;
+
+    // Every 1000th row's first line, by walking the rows
+    int64_t *first = malloc(sizeof(int64_t) * (E.num_rows / 1000 + 1)), v = 0, at = 0;
+    RopeNode *leaf;
+    for (leaf = rope_first_leaf(); leaf; leaf = leaf->next){
+        int j;
+        for (j = 0; j < leaf->n; j++, at++){
+            if (at % 1000 == 0) first[at / 1000] = v;
+            v += leaf->u.row[j].vlines;
+        }
+    }
+    int same = v == E.root->vlines;
+    int64_t sub, sum = 0;
+    start = bench_now();
+    for (i = 0; i < 1000000; i++) sum += rope_vline((int64_t)i * 1999 % E.num_rows);
+    double to_line = bench_now() - start;
+    start = bench_now();
+    for (i = 0; i < 1000000; i++) sum += rope_vline_row((int64_t)i * 3989 % v, &sub);
+    double to_row = bench_now() - start;
+    for (at = 0; at < E.num_rows; at += 1000){
+        same &= rope_vline(at) == first[at / 1000] && rope_vline_row(first[at / 1000], &sub) == at && sub == 0;
+    }
+
+    // The first frame down there also finds the lexer state above it
+    E.cy = E.num_rows * 3 / 4;
+    E.cx = 0;
+    E.row_off = 0;
+    screen.out.len = 0;
+    editor_render(&screen.out);
+    E.cy += 1000;
+    start = bench_now();
+    screen.out.len = 0;
+    editor_render(&screen.out);
+    double frame = bench_now() - start;
+    same &= E.row_off + E.screen_rows >= E.cy && E.row_off < E.cy;
+
+    printf("wrap   %" PRId64 " rows %" PRId64 " lines  counted in %.0f ms  row to line %.0f ns  line to row %.0f ns  frame %.0f us%s\n",
+        E.num_rows, v, counted * 1e3, to_line * 1e9 / 1000000, to_row * 1e9 / 1000000, frame * 1e6,
+        same && sum ? "" : "  MISMATCH");
+    free(first);
+}
+
+// Splitting a 256 MB CSV with CRLF line ends into rows, a window of rows at a
+// time on the main thread and then across the work pool, and a real file if
+// one is given, mapped and split whole
+void bench_load(char *file_name){
+    size_t len = 0, cap = (size_t)256 << 20;
+    char *text = malloc(cap + 256);
+    srand(1);
+    while (len < cap){
+        len += sprintf(&text[len], "%d,%s,%d.%02d,\"%s\"\r\n", rand() % 100000,
+            "etaoin shrdlu" + rand() % 13, rand() % 1000, rand() % 100, "cmfwyp vbgkqj" + rand() % 13);
+    }
+    E.match_cur = -1;
+    E.screen_cols = 200;
+
+    RopeNode *root[2];
+    int64_t rows[2], lines[2];
+    double took[2];
+    int k;
+    for (k = 0; k < 2; k++){
+        E.root = rope_new_node(1);
+        E.num_rows = 0;
+        E.map = text;
+        E.map_len = len;
+        E.map_off = 0;
+        E.map_lines = 0;
+        double start = bench_now();
+        if (k == 0){
+            while (E.map_off < E.map_len) editor_index_rows(E.num_rows + SPLIT_BULK_ROWS - 2);
+        }else{
+            editor_index_rows(INT64_MAX);
+        }
+        took[k] = bench_now() - start;
+        root[k] = E.root;
+        rows[k] = E.num_rows;
+        lines[k] = E.map_lines;
+    }
+
+    int same = rows[0] == rows[1] && lines[0] == lines[1] && root[1]->rows == rows[1];
+    RopeNode *a, *b;
+    for (a = root[0]; !a->leaf; a = a->u.child[0]);
+    for (b = root[1]; !b->leaf; b = b->u.child[0]);
+    int i = 0, j = 0;
+    while (same && a && b){
+        Erow *x = &a->u.row[i], *y = &b->u.row[j];
+        same &= x->chars == y->chars && x->size == y->size && x->size > 0 && x->chars[x->size - 1] == '"';
+        if (++i == a->n){ a = a->next; i = 0; }
+        if (++j == b->n){ b = b->next; j = 0; }
+    }
+    same &= a == NULL && b == NULL;
+    printf("load   %zu MB CSV %" PRId64 " rows  serial %.0f ms %.2f GB/s  %d threads %.0f ms %.2f GB/s%s\n",
+        len >> 20, rows[1], took[0] * 1e3, len / took[0] / 1e9, pool_threads() + 1,
+        took[1] * 1e3, len / took[1] / 1e9, same ? "" : "  MISMATCH");
+
+    if (file_name){
+        E.root = rope_new_node(1);
+        E.num_rows = 0;
+        E.map = NULL;
+        E.map_len = 0;
+        double start = bench_now();
+        editor_open(file_name);
+        editor_index_rows(INT64_MAX);
+        double t = bench_now() - start;
+        printf("load   %s %.0f MB %" PRId64 " rows  %.0f ms %.2f GB/s\n",
+            file_name, E.map_len / 1e6, E.num_rows, t * 1e3, E.map_len / t / 1e9);
+    }
+}
+
+// Bytes resident for the whole process
+double bench_rss(){
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f){
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+        fclose(f);
+    }
+    return (double)resident * sysconf(_SC_PAGESIZE);
+}
+
+// What a million short rows of source cost to hold, split off the map, then
+// drawn once and then each typed into, and that deleting them gives it back
+void bench_rows(){
+    int64_t n = 1000000;
+    size_t len = 0, cap = (size_t)n * 64;
+    char *text = malloc(cap);
+    int64_t i;
+    srand(1);
+    for (i = 0; i < n; i++){
+        int indent = rand() % 3;
+        if (i % 4 == 0) len += sprintf(&text[len], "\t\tx = %d;", rand());
+        else len += sprintf(&text[len], "%.*sif (%s) f(%d);", indent * 4, "            ",
+            "etaoin shrdlu" + rand() % 13, rand() % 1000);
+        text[len++] = '\n';
+    }
+    E.root = rope_new_node(1);
+    E.map = text;
+    E.map_len = len;
+    E.map_off = 0;
+    E.match_cur = -1;
+    E.screen_cols = 200;
+    E.filename = "rows.c";
+    editor_select_syntax_highlight();
+
+    double rss[4];
+    rss[0] = bench_rss();
+    editor_index_rows(INT64_MAX);
+    rss[1] = bench_rss();
+    for (i = 0; i < E.num_rows; i++) editor_row_rendered(i);
+    rss[2] = bench_rss();
+    // hl held past the views, against the byte a column it took before
+    int64_t hl_bytes = 0, columns = 0;
+    for (i = 0; i < E.num_rows; i++){
+        RowView *v = editor_row(i)->view;
+        if (v->hl_len > HL_INLINE) hl_bytes += slab_size(v->hl_len);
+        columns += v->rsize;
+    }
+    for (i = 0; i < E.num_rows; i++) editor_row_insert_char(i, 0, ' ');
+    rss[3] = bench_rss();
+    int same = E.num_rows == n;
+    char *line = text;
+    for (i = 0; same && i < n; i++){
+        Erow *row = editor_row(i);
+        int64_t l = strchr(line, '\n') - line;
+        same &= row->size == l + 1 && row->chars[0] == ' ' && !memcmp(&row->chars[1], line, l);
+        line += l + 1;
+    }
+    while (E.num_rows) editor_del_row(E.num_rows - 1);
+
+    printf("rows   %" PRId64 " rows  split %.0f bytes/row  drawn %.0f bytes/row (hl %.1f for %.1f columns)  typed into %.0f bytes/row  %ld slabs, %ld blocks left%s\n",
+        n, (rss[1] - rss[0]) / n, (rss[2] - rss[0]) / n, (double)hl_bytes / n, (double)columns / n,
+        (rss[3] - rss[0]) / n, slabs.slabs, slabs.blocks,
+        same && slabs.blocks == 0 ? "" : "  MISMATCH");
+    free(text);
+}
+
+// Whether rows [0, E.num_rows) are the lines of text with n of them cut at gap
+int bench_undo_same(const char *text, int64_t rows, int64_t gap, int64_t n){
+    if (E.num_rows != rows - n) return 0;
+    const char *line = text;
+    int64_t i, r = 0;
+    for (i = 0; i < rows; i++){
+        int64_t l = strchr(line, '\n') - line;
+        if (i < gap || i >= gap + n){
+            Erow *row = editor_row(r++);
+            if (row->size != l || memcmp(row->chars, line, l)) return 0;
+        }
+        line += l + 1;
+    }
+    return 1;
+}
+
+// Typing run on into a few ops, then bulk row deletes out of a million rows
+// undone and redone with history past a small budget written out
+void bench_undo(){
+    int64_t n = 1000000, i;
+    size_t len = 0, cap = (size_t)n * 64;
+    char *text = malloc(cap);
+    srand(1);
+    for (i = 0; i < n; i++){
+        len += sprintf(&text[len], "    if (%s) f(%d);", "etaoin shrdlu" + rand() % 13, rand() % 1000);
+        text[len++] = '\n';
+    }
+    E.root = rope_new_node(1);
+    E.map = text;
+    E.map_len = len;
+    E.map_off = 0;
+    E.match_cur = -1;
+    E.screen_cols = 200;
+    editor_index_rows(INT64_MAX);
+    undo.off = 0;
+    undo.budget = 1 << 20;
+
+    // Typing and backspacing in the middle of a row
+    int keys = 10000, steps = 0;
+    E.cy = 10;
+    E.cx = 4;
+    for (i = 0; i < keys; i++){
+        undo_begin(UNDO_KEY_TYPE);
+        editor_insert_char('a' + i % 26);
+        undo_end();
+    }
+    for (i = 0; i < keys / 2; i++){
+        undo_begin(UNDO_KEY_DELETE);
+        editor_del_char();
+        undo_end();
+    }
+    int64_t ops = 0, at;
+    for (at = 0; at < undo.end; ops++){
+        UndoOp op;
+        undo_op_at(at, &op);
+        undo_op_free(&op);
+        at = op.start + op.size;
+    }
+    while (undo.pos > 0){
+        editor_undo();
+        steps++;
+    }
+    int same = bench_undo_same(text, n, 0, 0) && E.cy == 10 && E.cx == 4;
+    printf("undo   %d keys typed, %d backspaced: %" PRId64 " ops, %d steps to undo%s\n",
+        keys, keys / 2, ops, steps, same ? "" : "  MISMATCH");
+
+    // The same rows cut, ten times as many the second time
+    int64_t count[2] = {10000, 100000}, gap = n / 3;
+    int k;
+    for (k = 0; k < 2; k++){
+        double took[3], start = bench_now();
+        E.cy = gap;
+        E.cx = 0;
+        undo_begin(UNDO_KEY_OTHER);
+        for (i = 0; i < count[k]; i++) editor_del_row(gap);
+        undo_end();
+        took[0] = bench_now() - start;
+        int64_t held = undo.end - undo.base, written = undo.base;
+        same = bench_undo_same(text, n, gap, count[k]);
+        start = bench_now();
+        editor_undo();
+        took[1] = bench_now() - start;
+        same &= bench_undo_same(text, n, 0, 0) && E.cy == gap;
+        start = bench_now();
+        editor_redo();
+        took[2] = bench_now() - start;
+        same &= bench_undo_same(text, n, gap, count[k]);
+        editor_undo();
+        same &= bench_undo_same(text, n, 0, 0);
+        printf("undo   %" PRId64 " of %" PRId64 " rows deleted %.1f ms  undone %.1f ms  redone %.1f ms  log %.1f MB held, %.1f MB written out%s\n",
+            count[k], n, took[0] * 1e3, took[1] * 1e3, took[2] * 1e3,
+            held / 1e6, written / 1e6, same ? "" : "  MISMATCH");
+    }
+    undo.off = 1;
+}
+
+// Lets the worker have the lock, as waiting for input does, until it has
+// been through every row
+double bench_hl_catch_up(){
+    double start = bench_now();
+    while (hl_next() < E.num_rows){
+        hl_release();
+        usleep(200);
+        pthread_mutex_lock(&hl.lock);
+    }
+    return bench_now() - start;
+}
+
+// Whether every row's end state is what lexing the file top down gives
+int bench_hl_check(){
+    int state = 0, same = 1;
+    RopeNode *leaf;
+    for (leaf = rope_first_leaf(); leaf; leaf = leaf->next){
+        int j;
+        for (j = 0; j < leaf->n; j++){
+            Erow *row = &leaf->u.row[j];
+            state = editor_lex(E.syntax, row->chars, row->size, state, NULL, -1);
+            same &= row->hl_state == (state | HL_STATE_KNOWN);
+        }
+    }
+    return same;
+}
+
+// A block comment opened at the top of 2M rows of C: the keystroke and the
+// frame at the bottom lexing every row on the main thread, then with the
+// worker catching up behind them, edits landing while it does
+void bench_hl(){
+    static const char *lines[] = {
+        "    int rx = 0; // columns so far",
+        "    if (row->chars[j] == '\\t') rx += (TAB_STOP - 1) - (rx % TAB_STOP);",
+        "    s = \"a /* b\";",
+        "}",
+    };
+    size_t len = 0, cap = (size_t)2000000 * 80;
+    char *text = malloc(cap);
+    int i;
+    for (i = 0; i < 2000000; i++){
+        size_t n = strlen(lines[i % 4]);
+        memcpy(&text[len], lines[i % 4], n);
+        len += n;
+        text[len++] = '\n';
+    }
+    E.root = rope_new_node(1);
+    E.map = text;
+    E.map_len = len;
+    E.map_off = 0;
+    E.match_cur = -1;
+    E.screen_rows = 58;
+    E.screen_cols = 200;
+    E.filename = "bench.c";
+    editor_select_syntax_highlight();
+    editor_index_rows(INT64_MAX);
+
+    // On the main thread
+    E.cy = E.row_off = 0;
+    screen.out.len = 0;
+    editor_render(&screen.out);
+    double start = bench_now();
+    editor_row_insert_char(0, 0, '*');
+    editor_row_insert_char(0, 0, '/');
+    screen.out.len = 0;
+    editor_render(&screen.out);
+    double key_sync = bench_now() - start;
+    E.cy = E.num_rows - 1;
+    start = bench_now();
+    screen.out.len = 0;
+    editor_render(&screen.out);
+    double far_sync = bench_now() - start;
+    int same = bench_hl_check();
+
+    // With the worker
+    editor_row_del_char(0, 0);
+    editor_row_del_char(0, 0);
+    E.cy = E.row_off = 0;
+    screen.out.len = 0;
+    editor_render(&screen.out);
+    hl_start();
+    double opened = bench_hl_catch_up();
+    same &= bench_hl_check();
+
+    start = bench_now();
+    editor_row_insert_char(0, 0, '*');
+    editor_row_insert_char(0, 0, '/');
+    screen.out.len = 0;
+    editor_render(&screen.out);
+    double key = bench_now() - start;
+    E.cy = E.num_rows * 3 / 4; // not drawn before, so plain for now
+    start = bench_now();
+    screen.out.len = 0;
+    editor_render(&screen.out);
+    double far = bench_now() - start;
+    int plain = hl_next() < E.cy && editor_row(E.cy)->hl_start == HL_STATE_NONE;
+
+    // Typing further up now and then while the worker is at it
+    for (i = 0; i < 50; i++){
+        hl_release();
+        usleep(500);
+        pthread_mutex_lock(&hl.lock);
+        editor_row_insert_char(10, 0, ' ');
+    }
+    double caught = bench_hl_catch_up();
+    same &= bench_hl_check();
+    screen.out.len = 0;
+    editor_render(&screen.out);
+    same &= plain && (editor_row_spans(editor_row(E.cy)->view)[0] & 15) == HL_MLCOMMENT;
+
+    printf("hl     %" PRId64 " rows  on the main thread: key %.2f ms  far frame %.1f ms  worker: opened in %.0f ms  key %.2f ms  far frame %.2f ms  caught up in %.0f ms  %ld batches %ld discarded%s\n",
+        E.num_rows, key_sync * 1e3, far_sync * 1e3, opened * 1e3, key * 1e3, far * 1e3, caught * 1e3,
+        hl.batches, hl.discarded, same ? "" : "  MISMATCH");
+}
+
+// Bytes written per frame while typing into and scrolling a screen of C at
+// 200x60, diffed against the previous frame and repainted in full
+void bench_render(){
+    static const char *lines[] = {
+        "int editor_row_cx_to_rx(Erow *row, int cx){",
+        "    int rx = 0; // columns so far",
+        "    for (j = 0; j < cx; j++){",
+        "        if (row->chars[j] == '\\t') rx += (TAB_STOP - 1) - (rx % TAB_STOP);",
+        "        rx++;",
+        "    }",
+        "    return rx;",
+        "}",
+        "",
+    };
+    E.root = rope_new_node(1);
+    E.screen_rows = 58;
+    E.screen_cols = 200;
+    E.match_cur = -1;
+    E.filename = "bench.c";
+    editor_select_syntax_highlight();
+    int i;
+    for (i = 0; i < 9000; i++) editor_insert_row(E.num_rows, (char *)lines[i % 9], strlen(lines[i % 9]));
+
+    // A hundred characters keep the typed row from scrolling sideways. The
+    // output buffer lives across frames as in the editor, so once it has
+    // grown no frame allocates
+    const char *name[2] = {"type", "scroll"};
+    int frames[2] = {100, 1000};
+    int op, full;
+    for (op = 0; op < 2; op++){
+        long bytes[2], reallocs[2];
+        double t[2];
+        for (full = 0; full < 2; full++){
+            E.cy = 20;
+            E.cx = 0;
+            E.row_off = 0;
+            screen.drawn = 0;
+            screen.out.len = 0;
+            editor_render(&screen.out);
+            bytes[full] = 0;
+            reallocs[full] = ab_reallocs;
+            double start = bench_now();
+            for (i = 0; i < frames[op]; i++){
+                if (op == 0){
+                    editor_insert_char('a' + i % 26);
+                }else{
+                    editor_move_cursor(ARROW_DOWN);
+                }
+                if (full) screen.drawn = 0;
+                screen.out.len = 0;
+                editor_render(&screen.out);
+                bytes[full] += screen.out.len;
+            }
+            t[full] = bench_now() - start;
+            reallocs[full] = ab_reallocs - reallocs[full];
+            if (op == 0) editor_del_row(20);
+        }
+        printf("render %-6s diffed %5.0f bytes %6.0f ns %.2f reallocs  repainted %5.0f bytes %6.0f ns %.2f reallocs  per frame\n",
+            name[op], (double)bytes[0] / frames[op], t[0] * 1e9 / frames[op], (double)reallocs[0] / frames[op],
+            (double)bytes[1] / frames[op], t[1] * 1e9 / frames[op], (double)reallocs[1] / frames[op]);
+    }
+}
+
+// A held arrow key and typed text arriving on stdin in one burst, as a
+// terminal's key repeat leaves it, decoded key by key
+void bench_input(){
+    int fd[2];
+    if (pipe(fd) == -1) die("pipe");
+    char burst[16384];
+    int len = 0, keys = 0;
+    while (len + 8 < (int)sizeof(burst)){
+        if (keys % 4 == 3){
+            memcpy(&burst[len], "\x1b[1;5C", 6);
+            len += 6;
+        }else{
+            memcpy(&burst[len], "\x1b[Bx", 4);
+            len += 4;
+            keys++;
+        }
+        keys++;
+    }
+    write(fd[1], burst, len);
+    close(fd[1]);
+    dup2(fd[0], STDIN_FILENO);
+
+    double start = bench_now();
+    long sum = 0;
+    int i;
+    for (i = 0; i < keys; i++) sum += editor_read_key();
+    double t = bench_now() - start;
+    printf("input  %d keys in %d bytes  %ld reads  %.1f ns/key%s\n", keys, len, input.reads,
+        t * 1e9 / keys, input.head == input.tail && sum ? "" : "  MISMATCH");
+}
+
+// The file bench_large works on: 2 GB of 1 MB lines, one line of 2.2 GB, 200
+// more 1 MB lines and a short last line, over 4 GB in all. Written to fd, or
+// compared against cmp when that is set, in which case edited has the '!'
+// the bench inserts. Returns the length, or -1 on a difference
+int64_t bench_large_file(int fd, const char *cmp, int edited){
+    static const char tail[] = "the end xyzzy\n", tail_edited[] = "the end !xyzzy\n";
+    size_t chunk = 1 << 20;
+    char *line = malloc(chunk);
+    size_t i;
+    for (i = 0; i < chunk; i++) line[i] = "etaoin shrdlu"[i % 13];
+    line[chunk - 1] = '\n';
+
+    int64_t off = 0;
+    int part, n;
+    for (part = 0; part < 4 && off >= 0; part++){
+        int count = part == 0 ? 2048 : part == 1 ? 2200 : part == 2 ? 200 : 1;
+        for (n = 0; n < count && off >= 0; n++){
+            const char *p = line;
+            size_t len = part == 1 ? chunk - 1 : chunk; // the long line gets its newline at the end
+            if (part == 1 && n == count - 1) p = line + 1;
+            if (part == 3){
+                p = edited ? tail_edited : tail;
+                len = strlen(p);
+            }
+            if (cmp){
+                if (memcmp(cmp + off, p, len)) off = -1;
+            }else if (write(fd, p, len) != (ssize_t)len){
+                die("write");
+            }
+            if (off >= 0) off += len;
+        }
+    }
+    free(line);
+    return off;
+}
+
+// Opens, edits, searches and saves a file too big for int sizes and offsets,
+// then checks the saved file byte for byte. Needs 10 GB free in dir
+void bench_large(char *dir){
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/jedit-large.txt", dir);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) die("open");
+    double start = bench_now();
+    int64_t len = bench_large_file(fd, NULL, 0);
+    close(fd);
+    printf("large  wrote %.2f GB in %.2fs\n", len / 1e9, bench_now() - start);
+
+    E.root = rope_new_node(1);
+    E.match_cur = -1;
+    start = bench_now();
+    editor_open(path);
+    editor_index_rows(INT64_MAX);
+    Erow *longest = editor_row(2048);
+    printf("large  %" PRId64 " rows, a row of %" PRId64 " bytes, split in %.2fs%s\n", E.num_rows,
+        longest->size, bench_now() - start,
+        E.num_rows == 2048 + 1 + 200 + 1 && longest->size == (int64_t)2200 * ((1 << 20) - 1) - 1 ? "" : "  MISMATCH");
+    if (tindex.nblocks){
+        start = bench_now();
+        while (!index_ready()) usleep(1000);
+        printf("large  index %d blocks ready after %.2fs\n", tindex.nblocks, bench_now() - start);
+    }
+
+    // Both the row past the long line and the match in it sit past 4 GB
+    SearchResults res = {0};
+    start = bench_now();
+    search_buffer(&res, "xyzzy", 5, NULL, 0, NULL);
+    Erow *last = editor_row(E.num_rows - 1);
+    printf("large  search in %.2fs, %ld matches%s\n", bench_now() - start, res.total,
+        res.total == 1 && res.match[0].row == E.num_rows - 1 && res.match[0].at == last->chars + 8 ? "" : "  MISMATCH");
+    free(res.match);
+
+    E.cy = E.num_rows - 1;
+    E.cx = 8;
+    editor_insert_char('!');
+    start = bench_now();
+    editor_save();
+    printf("large  saved in %.2fs: %s\n", bench_now() - start, E.statusmsg);
+
+    fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) die("open");
+    char *map = st.st_size == len + 1 ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    int same = map != MAP_FAILED && bench_large_file(-1, map, 1) == len + 1;
+    printf("large  saved file %s\n", same ? "matches" : "MISMATCH");
+    if (map != MAP_FAILED) munmap(map, st.st_size);
+    unlink(path);
+}
+
+int editor_bench(int argc, char *argv[]){
+    undo.off = 1; // only the undo bench keeps history
+    if (argc >= 1 && !strcmp(argv[0], "keywords")){
+        bench_keywords();
+        return 0;
+    }
+    if (argc >= 1 && !strcmp(argv[0], "search")){
+        bench_search(argc >= 2 ? argv[1] : NULL);
+        return 0;
+    }
+    if (argc >= 1 && !strcmp(argv[0], "wrap")){
+        bench_wrap();
+        return 0;
+    }
+    if (argc >= 1 && !strcmp(argv[0], "load")){
+        bench_load(argc >= 2 ? argv[1] : NULL);
+        return 0;
+    }
+    if (argc >= 1 && !strcmp(argv[0], "rows")){
+        bench_rows();
+        return 0;
+    }
+    if (argc >= 1 && !strcmp(argv[0], "undo")){
+        bench_undo();
+        return 0;
+    }
+    if (argc >= 1 && !strcmp(argv[0], "hl")){
+        bench_hl();
+        return 0;
+    }
+    if (argc >= 1 && !strcmp(argv[0], "render")){
+        bench_render();
+        return 0;
+    }
+    if (argc >= 1 && !strcmp(argv[0], "edit")){
+        bench_edit();
+        return 0;
+    }
+    if (argc >= 1 && !strcmp(argv[0], "input")){
+        bench_input();
+        return 0;
+    }
+    if (argc >= 1 && !strcmp(argv[0], "large")){
+        bench_large(argc >= 2 ? argv[1] : "/tmp");
+        return 0;
+    }
+    fprintf(stderr, "usage: jedit --bench keywords | search [file] | edit | wrap | load [file] | rows | undo | hl | render | input | large [dir]\n");
+    return 1;
+}
+#endif
+
 //---init---
 void init_editor(){
     E.cx = 0;
@@ -1082,7 +6099,16 @@ void init_editor(){
     E.rx = 0;
     E.row_off = 0;
     E.num_rows = 0;
-    E.row = NULL;
+    E.root = rope_new_node(1);
+    E.map = NULL;
+    E.map_len = 0;
+    E.map_off = 0;
+    E.hl_ndirty = 0;
+    E.match_cur = -1;
+    E.match_row = -1;
+    E.match_len = 0;
+    E.match_total = 0;
+    E.match_regex = 0;
     E.filename = NULL;
     E.dirty = 0;
     E.statusmsg[0] = '\0';
@@ -1096,18 +6122,24 @@ void init_editor(){
 }
 
 int main(int argc, char *argv[]){
+#ifdef JEDIT_BENCH
+    if (argc >= 2 && !strcmp(argv[1], "--bench")) return editor_bench(argc - 2, argv + 2);
+#endif
     system("clear");
     enable_raw_mode();
 
     init_editor();
+    signal(SIGWINCH, handle_winch);
+    input_wake_open();
     if (argc >= 2){
         editor_open(argv[1]);
     }
+    hl_start();
 
-    editor_set_status_message("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+    editor_set_status_message("HELP: ^S save ^Q quit ^F find ^R replace ^T stats ^W wrap ^Z undo ^Y redo");
 
     while (1){
-        editor_refresh_screen();
+        editor_schedule_refresh();
         editor_process_keypress();
     }
 